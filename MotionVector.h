@@ -1,7 +1,17 @@
 #pragma once
 
+#include <array>
 #include <vector>
 
+// Vector of one quarter of a split block, positions are absolute like in
+// MotionVector
+struct SubVector {
+    int _h;
+    int _w;
+    int _error;
+    int shift_dir;
+};
+
 class MotionVector {
 public:
     MotionVector() = default;
@@ -20,11 +30,24 @@ public:
         _splitted = false;
         shift_dir = 0;
     }
+    // Quarters in the order top-left, top-right, bottom-right, bottom-left
+    MotionVector(const std::array<MotionVector, 4>& subvectors, int error = 0) {
+        _h = 0;
+        _w = 0;
+        _splitted = true;
+        for (int i = 0; i < 4; i++) {
+            _subvectors[i] = {subvectors[i]._h, subvectors[i]._w, subvectors[i]._error, subvectors[i].shift_dir};
+        }
+        shift_dir = 0;
+        _error = error;
+    }
     MotionVector(const std::vector<MotionVector>& subvectors, int error = 0) {
         _h = 0;
         _w = 0;
         _splitted = true;
-        _subvectors = subvectors;
+        for (size_t i = 0; i < 4 && i < subvectors.size(); i++) {
+            _subvectors[i] = {subvectors[i]._h, subvectors[i]._w, subvectors[i]._error, subvectors[i].shift_dir};
+        }
         shift_dir = 0;
         _error = error;
     }
@@ -48,10 +71,20 @@ public:
         return this -> _error;
     }
     std::vector<MotionVector> getSubvectors() {
-        return this -> _subvectors;
+        std::vector<MotionVector> subvectors;
+        if (_splitted) {
+            for (const auto& subvector : _subvectors) {
+                subvectors.emplace_back(subvector._h, subvector._w, subvector._error, subvector.shift_dir);
+            }
+        }
+        return subvectors;
     }
     int shift_dir;
-    std::vector<MotionVector> _subvectors;
+    // Reference the vector points into: 0 - the nearest one, i - the
+    // reference of i Estimate calls before
+    int reference = 0;
+    // Kept inline, so that splitting a block does not allocate
+    std::array<SubVector, 4> _subvectors;
     bool _splitted;
     int _error;
     int _h;
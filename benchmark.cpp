@@ -0,0 +1,344 @@
+// Native benchmark of the search methods and the kernels under them on
+// synthetic content. Prints one JSON object per measurement, so runs can be
+// stored and compared:
+//
+//     me_benchmark [--frames N] [--resolution WxH]... [--method NAME]...
+//                  [--block-size N] [--min-block-size N] [--references N]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "my_motion_estimator.h"
+
+namespace {
+
+const char* const method_names[] = {
+    "BruteForce",
+    "CrossSearch",
+    "OrthonormalSearch",
+    "3DRS",
+    "ThreeStepSearch",
+    "DiamondSearch",
+    "HexagonSearch"
+};
+constexpr int method_count = sizeof(method_names) / sizeof(method_names[0]);
+
+enum Scene {
+    Static = 0,
+    Pan,
+    LocalMotion,
+    Noise,
+    Flash
+};
+const char* const scene_names[] = {"static", "pan", "local_motion", "noise", "flash"};
+constexpr int scene_count = sizeof(scene_names) / sizeof(scene_names[0]);
+
+// Fixed seeds, so every run sees the same frames
+class Random {
+public:
+    explicit Random(uint64_t seed) : _state(seed) {};
+    uint32_t Next() {
+        this -> _state = _state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return uint32_t(_state >> 33);
+    };
+    int Uniform(int low, int high) {
+        return low + int(Next() % uint32_t(high - low + 1));
+    };
+private:
+    uint64_t _state;
+};
+
+double Seconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+// Random texture smoothed with a box filter: detailed enough for the
+// searches to lock on, smooth enough for the sub-pixel planes to matter
+std::vector<unsigned char> MakeTexture(int height, int width, uint64_t seed) {
+    Random random(seed);
+    std::vector<int> noise(size_t(height) * width);
+    for (auto& value : noise) {
+        value = random.Uniform(0, 255);
+    }
+    const int radius = 2;
+    std::vector<unsigned char> texture(noise.size());
+    for (int h = 0; h < height; h++) {
+        for (int w = 0; w < width; w++) {
+            int sum = 0, count = 0;
+            for (int dh = -radius; dh <= radius; dh++) {
+                for (int dw = -radius; dw <= radius; dw++) {
+                    int y = std::min(std::max(h + dh, 0), height - 1);
+                    int x = std::min(std::max(w + dw, 0), width - 1);
+                    sum += noise[size_t(y) * width + x];
+                    count++;
+                }
+            }
+            // Stretch the contrast back, averaging pulls everything to 128
+            int value = 128 + (sum / count - 128) * 3;
+            texture[size_t(h) * width + w] = (unsigned char)std::min(std::max(value, 0), 255);
+        }
+    }
+    return texture;
+}
+
+// `frame_count` frames of one scene, each padded to getPaddedFrameSize()
+std::vector<std::vector<unsigned char>> MakeScene(
+    Scene scene,
+    const MotionEstimator& estimator,
+    int frame_count
+) {
+    const int height = estimator.getHeight(), width = estimator.getWidth();
+    const int max_speed = 6;
+    const int margin = max_speed * frame_count;
+    const int canvas_height = height + 2 * margin, canvas_width = width + 2 * margin;
+    std::vector<unsigned char> background = MakeTexture(canvas_height, canvas_width, 1);
+    std::vector<unsigned char> foreground = MakeTexture(canvas_height, canvas_width, 2);
+
+    struct Object {
+        int h, w, size, dh, dw;
+    };
+    Random random(3);
+    std::vector<Object> objects;
+    if (scene == Scene::LocalMotion) {
+        int object_count = std::max(1, height * width / (96 * 96));
+        for (int i = 0; i < object_count; i++) {
+            int size = random.Uniform(16, 96);
+            objects.push_back({
+                random.Uniform(0, height - 1), random.Uniform(0, width - 1), size,
+                random.Uniform(-max_speed, max_speed), random.Uniform(-max_speed, max_speed)
+            });
+        }
+    }
+
+    std::vector<std::vector<unsigned char>> frames;
+    for (int t = 0; t < frame_count; t++) {
+        std::vector<unsigned char> frame(estimator.getPaddedFrameSize());
+        // Global pan of (1, 3) pixels per frame
+        bool pan = scene == Scene::Pan || scene == Scene::Flash;
+        int origin_h = margin + (pan ? t : 0);
+        int origin_w = margin + (pan ? 3 * t : 0);
+        for (int h = 0; h < height; h++) {
+            memcpy(
+                frame.data() + size_t(h) * width,
+                background.data() + size_t(origin_h + h) * canvas_width + origin_w,
+                width
+            );
+        }
+        for (const Object& object : objects) {
+            int top = object.h + t * object.dh, left = object.w + t * object.dw;
+            for (int h = std::max(top, 0); h < std::min(top + object.size, height); h++) {
+                for (int w = std::max(left, 0); w < std::min(left + object.size, width); w++) {
+                    // The object carries its texture along
+                    frame[size_t(h) * width + w] =
+                        foreground[size_t(margin + h - top) * canvas_width + margin + w - left];
+                }
+            }
+        }
+        if (scene == Scene::Noise) {
+            // Roughly gaussian, sigma of about 5
+            for (int i = 0; i < height * width; i++) {
+                int value = frame[i] + random.Uniform(-6, 6) + random.Uniform(-6, 6) + random.Uniform(-6, 6);
+                frame[i] = (unsigned char)std::min(std::max(value, 0), 255);
+            }
+        }
+        if (scene == Scene::Flash && t % 4 == 2) {
+            // One washed-out frame in four, only older references match the next one
+            for (int i = 0; i < height * width; i++) {
+                frame[i] = (unsigned char)(128 + frame[i] / 2);
+            }
+        }
+        estimator.PadFrame(frame.data());
+        frames.push_back(std::move(frame));
+    }
+    return frames;
+}
+
+void BenchmarkSearch(
+    int width,
+    int height,
+    bool use_halfpixel,
+    int method,
+    Scene scene,
+    int frame_count,
+    int block_size,
+    int min_block_size,
+    int reference_count,
+    bool change_detection
+) {
+    MotionEstimator estimator(width, height, 100, use_halfpixel, block_size, min_block_size);
+    estimator.setSearchMethod(method);
+    estimator.setReferenceCount(reference_count);
+    estimator.setChangeDetection(change_detection);
+    auto frames = MakeScene(scene, estimator, frame_count);
+    std::vector<unsigned char> compensated(size_t(height) * width);
+
+    double estimate_seconds = 0, remap_seconds = 0, psnr_sum = 0;
+    uint64_t evaluations = 0;
+    for (int t = 1; t < frame_count; t++) {
+        auto start = std::chrono::steady_clock::now();
+        estimator.EstimateFrame(frames[t - 1].data(), frames[t].data());
+        auto estimated = std::chrono::steady_clock::now();
+        estimator.RemapFrame(compensated.data());
+        auto remapped = std::chrono::steady_clock::now();
+        estimate_seconds += Seconds(estimated - start);
+        remap_seconds += Seconds(remapped - estimated);
+        evaluations += estimator.get_EvaluationCount().first;
+        // Measured outside of the timed part
+        QualityMetrics metrics = estimator.RemapFrame(compensated.data(), frames[t].data());
+        // Identical frames would make the mean infinite
+        psnr_sum += std::min(metrics.psnr, 100.0);
+    }
+    int pairs = frame_count - 1;
+    double blocks = double(estimator.getBlocksPerRow()) * estimator.getBlocksPerColumn();
+    printf(
+        "{\"benchmark\": \"search\", \"method\": \"%s\", \"scene\": \"%s\", \"width\": %d, \"height\": %d, "
+        "\"block_size\": %d, \"min_block_size\": %d, \"references\": %d, \"change_detection\": %s, "
+        "\"halfpel\": %s, \"frames\": %d, \"ms_per_frame\": %.4f, \"remap_ms_per_frame\": %.4f, "
+        "\"evaluations_per_block\": %.2f, \"psnr\": %.4f}\n",
+        method_names[method], scene_names[scene], width, height, block_size, min_block_size, reference_count,
+        change_detection ? "true" : "false",
+        use_halfpixel ? "true" : "false", pairs,
+        estimate_seconds * 1000 / pairs, remap_seconds * 1000 / pairs,
+        evaluations / (blocks * pairs), psnr_sum / pairs
+    );
+    fflush(stdout);
+}
+
+void BenchmarkKernels(int width, int height, int frame_count) {
+    MotionEstimator estimator(width, height, 100, true);
+    auto frames = MakeScene(Scene::Pan, estimator, 2);
+    const int border = 2 * estimator.getBlockSize();
+    const size_t extended_size = size_t(height + 2 * border) * (width + 2 * border);
+    std::vector<unsigned char> up(extended_size), left(extended_size), up_left(extended_size);
+    std::vector<unsigned char> extended(extended_size);
+    const int repeat = std::max(frame_count, 1);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        estimator.GenerateSubpixelArrays(frames[0].data(), up.data(), left.data(), up_left.data(), height, width);
+    }
+    double subpixel_seconds = Seconds(std::chrono::steady_clock::now() - start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        estimator.ExtendBorders(frames[0].data(), extended.data());
+    }
+    double extend_seconds = Seconds(std::chrono::steady_clock::now() - start);
+
+    // Every block of the frame against the co-located block of the next one
+    // and its 8 neighbours one pixel away
+    Matrix previous(frames[0].data(), height, width);
+    Matrix current(frames[1].data(), height, width);
+    const int block_size = estimator.getBlockSize();
+    uint64_t calls = 0;
+    int64_t checksum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++) {
+        for (int h = 1; h + block_size + 1 <= height; h += block_size) {
+            for (int w = 1; w + block_size + 1 <= width; w += block_size) {
+                for (int dh = -1; dh <= 1; dh++) {
+                    for (int dw = -1; dw <= 1; dw++) {
+                        checksum += estimator.ComputeAbsDifference(previous, h + dh, w + dw, current, h, w, block_size);
+                        calls++;
+                    }
+                }
+            }
+        }
+    }
+    double difference_seconds = Seconds(std::chrono::steady_clock::now() - start);
+
+    printf(
+        "{\"benchmark\": \"GenerateSubpixelArrays\", \"width\": %d, \"height\": %d, \"ms_per_frame\": %.4f}\n",
+        width, height, subpixel_seconds * 1000 / repeat
+    );
+    printf(
+        "{\"benchmark\": \"ExtendBorders\", \"width\": %d, \"height\": %d, \"ms_per_frame\": %.4f}\n",
+        width, height, extend_seconds * 1000 / repeat
+    );
+    printf(
+        "{\"benchmark\": \"ComputeAbsDifference\", \"width\": %d, \"height\": %d, \"block_size\": %d, "
+        "\"ns_per_call\": %.2f, \"checksum\": %lld}\n",
+        width, height, block_size, difference_seconds * 1e9 / std::max<uint64_t>(calls, 1), (long long)checksum
+    );
+    fflush(stdout);
+}
+
+int FindMethod(const std::string& name) {
+    for (int method = 0; method < method_count; method++) {
+        if (name == method_names[method]) {
+            return method;
+        }
+    }
+    throw std::invalid_argument("Unknown search method " + name);
+}
+
+}
+
+int main(int argc, char** argv) {
+    int frame_count = 10;
+    int block_size = 16, min_block_size = 8, reference_count = 1;
+    bool change_detection = false;
+    std::vector<std::pair<int, int>> resolutions;
+    std::vector<int> methods;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string argument = argv[i];
+            if (i + 1 == argc) {
+                throw std::invalid_argument("Missing value of " + argument);
+            }
+            std::string value = argv[++i];
+            if (argument == "--frames") {
+                frame_count = std::stoi(value);
+                if (frame_count < 2) {
+                    throw std::invalid_argument("At least 2 frames are needed");
+                }
+            } else if (argument == "--resolution") {
+                int width = 0, height = 0;
+                if (sscanf(value.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                    throw std::invalid_argument("Resolution has to be WxH, got " + value);
+                }
+                resolutions.push_back({width, height});
+            } else if (argument == "--method") {
+                methods.push_back(FindMethod(value));
+            } else if (argument == "--block-size") {
+                block_size = std::stoi(value);
+            } else if (argument == "--min-block-size") {
+                min_block_size = std::stoi(value);
+            } else if (argument == "--references") {
+                reference_count = std::stoi(value);
+            } else if (argument == "--change-detection") {
+                change_detection = std::stoi(value) != 0;
+            } else {
+                throw std::invalid_argument("Unknown argument " + argument);
+            }
+        }
+    } catch (const std::exception& error) {
+        fprintf(stderr, "%s\n", error.what());
+        fprintf(stderr, "usage: %s [--frames N] [--resolution WxH]... [--method NAME]... [--block-size N] [--min-block-size N] [--references N] [--change-detection 0|1]\n", argv[0]);
+        return 1;
+    }
+    if (resolutions.empty()) {
+        resolutions = {{352, 288}, {1280, 720}, {1920, 1080}};
+    }
+    if (methods.empty()) {
+        for (int method = 0; method < method_count; method++) {
+            methods.push_back(method);
+        }
+    }
+
+    for (const auto& resolution : resolutions) {
+        BenchmarkKernels(resolution.first, resolution.second, frame_count);
+        for (int method : methods) {
+            for (int scene = 0; scene < scene_count; scene++) {
+                for (bool use_halfpixel : {false, true}) {
+                    BenchmarkSearch(resolution.first, resolution.second, use_halfpixel, method, Scene(scene), frame_count, block_size, min_block_size, reference_count, change_detection);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include "frame_quality.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+#if defined(__SSE2__)
+// Adds two vectors of 4 to 8 consecutive column sums
+inline void AddSums(int32_t* sums, __m128i low, __m128i high) {
+    __m128i* first = reinterpret_cast<__m128i*>(sums);
+    _mm_storeu_si128(first, _mm_add_epi32(_mm_loadu_si128(first), low));
+    _mm_storeu_si128(first + 1, _mm_add_epi32(_mm_loadu_si128(first + 1), high));
+}
+#endif
+
+}
+
+FrameQuality::FrameQuality(int height, int width) :
+    _height(height),
+    _width(width),
+    _sum_x(width, 0),
+    _sum_y(width, 0),
+    _sum_xx(width, 0),
+    _sum_yy(width, 0),
+    _sum_xy(width, 0),
+    _zeros(width, 0),
+    _window_x(std::max(width - _window + 1, 0)),
+    _window_y(std::max(width - _window + 1, 0)),
+    _window_xx(std::max(width - _window + 1, 0)),
+    _window_yy(std::max(width - _window + 1, 0)),
+    _window_xy(std::max(width - _window + 1, 0)) {}
+
+void FrameQuality::AddRows(
+    const unsigned char* compensated,
+    ptrdiff_t compensated_stride,
+    const unsigned char* target,
+    ptrdiff_t target_stride,
+    int top,
+    int bottom
+) {
+    for (int row = top; row < bottom; row++) {
+        AddRow(compensated, compensated_stride, target, target_stride, row);
+    }
+}
+
+void FrameQuality::AddRow(
+    const unsigned char* compensated,
+    ptrdiff_t compensated_stride,
+    const unsigned char* target,
+    ptrdiff_t target_stride,
+    int row
+) {
+    // Column sums slide down by one row: the new row enters, the row seven
+    // above it leaves. Rows above the frame count as zeros.
+    const unsigned char* x = compensated + row * compensated_stride;
+    const unsigned char* y = target + row * target_stride;
+    const unsigned char* old_x = row >= _window ? x - _window * compensated_stride : _zeros.data();
+    const unsigned char* old_y = row >= _window ? y - _window * target_stride : _zeros.data();
+    int32_t* sum_x = _sum_x.data();
+    int32_t* sum_y = _sum_y.data();
+    int32_t* sum_xx = _sum_xx.data();
+    int32_t* sum_yy = _sum_yy.data();
+    int32_t* sum_xy = _sum_xy.data();
+    int32_t sad = 0, squared_error = 0;
+    int column = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i sad_sum = zero, squared_sum = zero;
+    for (; column + 8 <= _width; column += 8) {
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(x + column)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y + column)), zero);
+        __m128i old_a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(old_x + column)), zero);
+        __m128i old_b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(old_y + column)), zero);
+        __m128i difference = _mm_sub_epi16(a, b);
+        sad_sum = _mm_add_epi32(sad_sum, _mm_sad_epu8(_mm_packus_epi16(a, zero), _mm_packus_epi16(b, zero)));
+        squared_sum = _mm_add_epi32(squared_sum, _mm_madd_epi16(difference, difference));
+        __m128i negative_old_a = _mm_sub_epi16(zero, old_a);
+        __m128i negative_old_b = _mm_sub_epi16(zero, old_b);
+        // Pairs (new, old) times (new, -old) give new^2 - old^2 per column
+        __m128i a_low = _mm_unpacklo_epi16(a, old_a), a_high = _mm_unpackhi_epi16(a, old_a);
+        __m128i b_low = _mm_unpacklo_epi16(b, old_b), b_high = _mm_unpackhi_epi16(b, old_b);
+        __m128i negative_a_low = _mm_unpacklo_epi16(a, negative_old_a), negative_a_high = _mm_unpackhi_epi16(a, negative_old_a);
+        __m128i negative_b_low = _mm_unpacklo_epi16(b, negative_old_b), negative_b_high = _mm_unpackhi_epi16(b, negative_old_b);
+        __m128i delta_x = _mm_add_epi16(a, negative_old_a), delta_y = _mm_add_epi16(b, negative_old_b);
+        AddSums(sum_x + column, _mm_srai_epi32(_mm_unpacklo_epi16(delta_x, delta_x), 16),
+                _mm_srai_epi32(_mm_unpackhi_epi16(delta_x, delta_x), 16));
+        AddSums(sum_y + column, _mm_srai_epi32(_mm_unpacklo_epi16(delta_y, delta_y), 16),
+                _mm_srai_epi32(_mm_unpackhi_epi16(delta_y, delta_y), 16));
+        AddSums(sum_xx + column, _mm_madd_epi16(a_low, negative_a_low), _mm_madd_epi16(a_high, negative_a_high));
+        AddSums(sum_yy + column, _mm_madd_epi16(b_low, negative_b_low), _mm_madd_epi16(b_high, negative_b_high));
+        AddSums(sum_xy + column, _mm_madd_epi16(a_low, negative_b_low), _mm_madd_epi16(a_high, negative_b_high));
+    }
+    sad = _mm_cvtsi128_si32(sad_sum);
+    squared_sum = _mm_add_epi32(squared_sum, _mm_shuffle_epi32(squared_sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    squared_sum = _mm_add_epi32(squared_sum, _mm_shuffle_epi32(squared_sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    squared_error = _mm_cvtsi128_si32(squared_sum);
+#endif
+    for (; column < _width; column++) {
+        int32_t a = x[column], b = y[column];
+        int32_t old_a = old_x[column], old_b = old_y[column];
+        int32_t difference = a - b;
+        sad += difference < 0 ? -difference : difference;
+        squared_error += difference * difference;
+        sum_x[column] += a - old_a;
+        sum_y[column] += b - old_b;
+        sum_xx[column] += a * a - old_a * old_a;
+        sum_yy[column] += b * b - old_b * old_b;
+        sum_xy[column] += a * b - old_a * old_b;
+    }
+    this -> _sad += sad;
+    this -> _squared_error += squared_error;
+    if (row < _window - 1 || _width < _window) {
+        return;
+    }
+
+    // Horizontal window sums first, so that the SSIM loop below has no
+    // dependency between columns and vectorises
+    int windows = _width - _window + 1;
+    int32_t sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    for (int column = 0; column < _width; column++) {
+        sx += _sum_x[column];
+        sy += _sum_y[column];
+        sxx += _sum_xx[column];
+        syy += _sum_yy[column];
+        sxy += _sum_xy[column];
+        if (column >= _window) {
+            sx -= _sum_x[column - _window];
+            sy -= _sum_y[column - _window];
+            sxx -= _sum_xx[column - _window];
+            syy -= _sum_yy[column - _window];
+            sxy -= _sum_xy[column - _window];
+        }
+        if (column >= _window - 1) {
+            int window = column - _window + 1;
+            _window_x[window] = sx;
+            _window_y[window] = sy;
+            _window_xx[window] = sxx;
+            _window_yy[window] = syy;
+            _window_xy[window] = sxy;
+        }
+    }
+
+    // The usual SSIM formula with means and sample (co)variances multiplied
+    // through by n^2 and n(n - 1), which leaves a single division and exact
+    // integer moments
+    constexpr int64_t n = _window * _window;
+    constexpr double c1 = (0.01 * 255) * (0.01 * 255) * n * n;
+    constexpr double c2 = (0.03 * 255) * (0.03 * 255) * n * (n - 1);
+    double ssim_sum = 0;
+    for (int window = 0; window < windows; window++) {
+        int64_t x = _window_x[window], y = _window_y[window];
+        int64_t variances = n * (_window_xx[window] + _window_yy[window]) - x * x - y * y;
+        int64_t covariance = n * _window_xy[window] - x * y;
+        ssim_sum += ((2 * x * y + c1) * (2 * covariance + c2)) /
+                    ((x * x + y * y + c1) * (variances + c2));
+    }
+    this -> _ssim_sum += ssim_sum;
+    this -> _ssim_count += windows;
+}
+
+QualityMetrics FrameQuality::Finish() const {
+    QualityMetrics metrics;
+    metrics.sad = this -> _sad;
+    metrics.mse = double(_squared_error) / (double(_height) * _width);
+    metrics.psnr = _squared_error == 0 ? std::numeric_limits<double>::infinity()
+                                       : 10 * std::log10(255.0 * 255.0 / metrics.mse);
+    metrics.ssim = _ssim_count == 0 ? std::numeric_limits<double>::quiet_NaN()
+                                    : _ssim_sum / _ssim_count;
+    return metrics;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Quality of a compensated frame against the frame it predicts
+struct QualityMetrics {
+    int64_t sad = 0;
+    double mse = 0;
+    // Infinite for identical frames
+    double psnr = 0;
+    // Mean SSIM over 7x7 windows, NaN if the frame is smaller than a window
+    double ssim = 0;
+};
+
+// Computes QualityMetrics from bands of rows handed over in order, as soon
+// as they are final, so the rows are still in cache. SSIM follows the
+// defaults of skimage.metrics.structural_similarity for uint8 frames:
+// uniform 7x7 windows, sample covariance, data range 255 and only the
+// windows that lie completely inside of the frame.
+class FrameQuality {
+public:
+    FrameQuality(int height, int width);
+
+    // Rows [top, bottom) of both frames, `top` is where the last band ended.
+    // The strides are the distances between the rows of each frame.
+    void AddRows(
+        const unsigned char* compensated,
+        ptrdiff_t compensated_stride,
+        const unsigned char* target,
+        ptrdiff_t target_stride,
+        int top,
+        int bottom
+    );
+    // Once every row was added
+    QualityMetrics Finish() const;
+private:
+    static constexpr int _window = 7;
+
+    // Errors of `row` and the SSIM of the windows ending in it
+    void AddRow(
+        const unsigned char* compensated,
+        ptrdiff_t compensated_stride,
+        const unsigned char* target,
+        ptrdiff_t target_stride,
+        int row
+    );
+
+    int _height;
+    int _width;
+    int64_t _sad = 0;
+    int64_t _squared_error = 0;
+    double _ssim_sum = 0;
+    int64_t _ssim_count = 0;
+    // Sums over the 7 rows ending in the current one, per column
+    std::vector<int32_t> _sum_x;
+    std::vector<int32_t> _sum_y;
+    std::vector<int32_t> _sum_xx;
+    std::vector<int32_t> _sum_yy;
+    std::vector<int32_t> _sum_xy;
+    std::vector<unsigned char> _zeros;
+    // Sums over the 7x7 window starting at each column, for the current row
+    std::vector<int32_t> _window_x;
+    std::vector<int32_t> _window_y;
+    std::vector<int32_t> _window_xx;
+    std::vector<int32_t> _window_yy;
+    std::vector<int32_t> _window_xy;
+};
@@ -0,0 +1,157 @@
+#include "halfpel.h"
+
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+#if defined(__SSE2__)
+// Truncated mean of two rows, pavgb rounds up, so the odd sums lose one
+inline __m128i mean2(__m128i a, __m128i b) {
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+inline __m128i mean4(__m128i a, __m128i b, __m128i c, __m128i d) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_add_epi16(
+        _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+        _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero))
+    );
+    __m128i high = _mm_add_epi16(
+        _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+        _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero))
+    );
+    return _mm_packus_epi16(_mm_srli_epi16(low, 2), _mm_srli_epi16(high, 2));
+}
+#endif
+
+// Columns [left, right) of one row below the first, left > 0
+void interpolate_row(
+    const unsigned char* current,
+    const unsigned char* above,
+    unsigned char* up,
+    unsigned char* left,
+    unsigned char* up_left,
+    int left_column,
+    int right_column
+) {
+    int x = left_column;
+#if defined(__SSE2__)
+    for (; x + 16 <= right_column; x += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(current + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(current + x - 1));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(above + x - 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(up + x), mean2(a, b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(left + x), mean2(a, c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(up_left + x), mean4(a, b, c, d));
+    }
+#endif
+    for (; x < right_column; x++) {
+        up[x] = (int(current[x]) + above[x]) >> 1;
+        left[x] = (int(current[x]) + current[x - 1]) >> 1;
+        up_left[x] = (int(current[x]) + above[x] + current[x - 1] + above[x - 1]) >> 2;
+    }
+}
+
+}
+
+void interpolate_halfpel(
+    const unsigned char* source,
+    unsigned char* up,
+    unsigned char* left,
+    unsigned char* up_left,
+    int width,
+    int top,
+    int bottom,
+    int left_column,
+    int right_column
+) {
+    for (int y = top; y < bottom; y++) {
+        size_t row = size_t(y) * width;
+        const unsigned char* current = source + row;
+        if (y == 0) {
+            for (int x = left_column; x < right_column; x++) {
+                up[row + x] = current[x];
+                left[row + x] = x > 0 ? (int(current[x]) + current[x - 1]) >> 1 : current[x];
+                up_left[row + x] = left[row + x];
+            }
+            continue;
+        }
+        int x = left_column;
+        if (x == 0) {
+            up[row] = (int(current[0]) + current[-width]) >> 1;
+            left[row] = current[0];
+            up_left[row] = up[row];
+            x = 1;
+        }
+        interpolate_row(current, current - width, up + row, left + row, up_left + row, x, right_column);
+    }
+}
+
+void HalfpelTiles::Reset(
+    const unsigned char* source,
+    unsigned char* up,
+    unsigned char* left,
+    unsigned char* up_left,
+    int height,
+    int width,
+    int border
+) {
+    this -> _source = source;
+    this -> _up = up;
+    this -> _left = left;
+    this -> _up_left = up_left;
+    this -> _height = height;
+    this -> _width = width;
+    this -> _border = border;
+    this -> _rows = (height + _tile_size - 1) / _tile_size;
+    this -> _columns = (width + _tile_size - 1) / _tile_size;
+    if (_rows * _columns > _capacity) {
+        this -> _capacity = _rows * _columns;
+        this -> _state.reset(new std::atomic<unsigned char>[_capacity]);
+    }
+    for (int tile = 0; tile < _rows * _columns; tile++) {
+        _state[tile].store(Empty, std::memory_order_relaxed);
+    }
+}
+
+void HalfpelTiles::EnsureAll() const {
+    for (int row = 0; row < _rows; row++) {
+        for (int column = 0; column < _columns; column++) {
+            if (_state[row * _columns + column].load(std::memory_order_acquire) != Built) {
+                Build(row, column);
+            }
+        }
+    }
+}
+
+int HalfpelTiles::getBuiltCount() const {
+    int count = 0;
+    for (int tile = 0; tile < _rows * _columns; tile++) {
+        count += _state[tile].load(std::memory_order_relaxed) == Built;
+    }
+    return count;
+}
+
+void HalfpelTiles::Build(int row, int column) const {
+    std::atomic<unsigned char>& state = _state[row * _columns + column];
+    unsigned char expected = Empty;
+    if (!state.compare_exchange_strong(expected, Building, std::memory_order_acquire)) {
+        // Another thread interpolates the tile right now
+        while (state.load(std::memory_order_acquire) != Built) {
+            std::this_thread::yield();
+        }
+        return;
+    }
+    int top = row * _tile_size, left_column = column * _tile_size;
+    interpolate_halfpel(
+        _source, _up, _left, _up_left, _width,
+        top, std::min(top + _tile_size, _height),
+        left_column, std::min(left_column + _tile_size, _width)
+    );
+    state.store(Built, std::memory_order_release);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+// Interpolates the half-pixel planes of `source` for rows [top, bottom) and
+// columns [left, right). All four buffers have rows `width` bytes apart.
+// Every pixel is the truncated mean of itself and the pixel above, to the
+// left, or of the 2x2 square ending in it. The first row and column have
+// no such neighbours and take the nearest plane that exists instead.
+void interpolate_halfpel(
+    const unsigned char* source,
+    unsigned char* up,
+    unsigned char* left,
+    unsigned char* up_left,
+    int width,
+    int top,
+    int bottom,
+    int left_column,
+    int right_column
+);
+
+// Half-pixel planes of one reference that are interpolated tile by tile, the
+// first time a block reads from a tile. Blocks are given in picture
+// coordinates, the planes may carry a border of `border` pixels around it.
+// Safe to use from several threads, a tile is built by one of them and the
+// others wait for it.
+class HalfpelTiles {
+public:
+    static constexpr int _tile_size = 64;
+
+    // Planes of height x width pixels, padding included. Forgets every tile.
+    void Reset(
+        const unsigned char* source,
+        unsigned char* up,
+        unsigned char* left,
+        unsigned char* up_left,
+        int height,
+        int width,
+        int border
+    );
+    // Builds the tiles under the block at (h, w) that are not built yet
+    void Ensure(int h, int w, int block_size) const {
+        h += _border;
+        w += _border;
+        int first_row = std::max(h, 0) / _tile_size;
+        int last_row = std::min(h + block_size, _height) - 1;
+        int first_column = std::max(w, 0) / _tile_size;
+        int last_column = std::min(w + block_size, _width) - 1;
+        for (int row = first_row; row <= last_row / _tile_size; row++) {
+            for (int column = first_column; column <= last_column / _tile_size; column++) {
+                if (_state[row * _columns + column].load(std::memory_order_acquire) != Built) {
+                    Build(row, column);
+                }
+            }
+        }
+    };
+    void EnsureAll() const;
+    // Tiles interpolated since the last Reset
+    int getBuiltCount() const;
+private:
+    enum State : unsigned char {
+        Empty = 0,
+        Building,
+        Built
+    };
+    void Build(int row, int column) const;
+
+    const unsigned char* _source = nullptr;
+    unsigned char* _up = nullptr;
+    unsigned char* _left = nullptr;
+    unsigned char* _up_left = nullptr;
+    int _height = 0;
+    int _width = 0;
+    int _border = 0;
+    int _rows = 0;
+    int _columns = 0;
+    int _capacity = 0;
+    std::unique_ptr<std::atomic<unsigned char>[]> _state;
+};
@@ -1,18 +1,401 @@
+#include <pybind11/functional.h>
+#include <pybind11/stl.h>
 #include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
 
 #include "my_motion_estimator.h"
+#include "video_pipeline.h"
 
 namespace py = pybind11;
 
+namespace {
+
+// Frames from Python, converted to contiguous uint8 if they are not
+typedef py::array_t<unsigned char, py::array::c_style | py::array::forcecast> FrameArray;
+
+FrameView View(const FrameArray& frame) {
+    if (frame.ndim() != 2) {
+        throw std::invalid_argument("Frames have to be 2-D arrays");
+    }
+    return {frame.data(), int(frame.shape(0)), int(frame.shape(1)), frame.strides(0)};
+}
+
+// Top-left pixel of the block at (h, w), which has to lie inside of `frame`
+const unsigned char* BlockAt(const FrameArray& frame, int h, int w, int block_size) {
+    if (frame.ndim() != 2 || h < 0 || w < 0 || h + block_size > frame.shape(0) || w + block_size > frame.shape(1)) {
+        throw std::invalid_argument("Block outside of the frame");
+    }
+    return frame.data() + h * frame.strides(0) + w;
+}
+
+}
+
+// The Python face of MotionEstimator. It converts numpy arrays to frame
+// views and releases the GIL for the native work, so estimators of different
+// streams run in parallel from Python threads.
+class PyMotionEstimator : public MotionEstimator {
+public:
+    using MotionEstimator::MotionEstimator;
+
+    // Returns the new field, see GetMotionField. The previous frame is kept
+    // alive until the next Estimate, Remap reads from it.
+    py::dict Estimate(FrameArray previous_frame, FrameArray current_frame) {
+        FrameView previous = View(previous_frame), current = View(current_frame);
+        CheckFrame(previous);
+        CheckFrame(current);
+        // Referenced with the GIL and swapped in without it, the reference
+        // it replaces is released at the end, with the GIL again
+        py::object pinned = previous_frame;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(getMutex());
+            EstimateFrame(previous, current);
+            std::swap(this -> _reference_frame, pinned);
+        }
+        return GetMotionField();
+    };
+    // numpy views of the last field, one entry per cell of the smallest
+    // block size: dy, dx, cost, phase, reference, the quad-tree depth of the
+    // leaf and the per-block split flags. Nothing is copied,
+    // the views keep the estimator alive and follow every later Estimate.
+    py::dict GetMotionField() {
+        return FieldViews(getMotionField());
+    };
+    // Bidirectional estimation of current_frame, returns the views of the
+    // forward and the backward field as {"forward": ..., "backward": ...}.
+    // past_frame is kept alive like the previous frame of Estimate, the
+    // future frame is copied.
+    py::dict EstimateBidirectional(FrameArray past_frame, FrameArray current_frame, FrameArray future_frame) {
+        FrameView past = View(past_frame), current = View(current_frame), future = View(future_frame);
+        CheckFrame(past);
+        CheckFrame(current);
+        CheckFrame(future);
+        py::object pinned = past_frame;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(getMutex());
+            EstimateBidirectionalFrame(past, current, future);
+            std::swap(this -> _reference_frame, pinned);
+        }
+        py::dict result;
+        result["forward"] = FieldViews(getMotionField());
+        result["backward"] = FieldViews(getBackwardField());
+        return result;
+    };
+    // Fields of every pair frames[i] -> frames[i + 1] of one stream, stacked
+    // along a new first axis. Accepts a 3-D array or a list of frames.
+    py::dict EstimateBatch(const std::vector<FrameArray>& frames) {
+        std::vector<FrameView> views;
+        for (const auto& frame : frames) {
+            views.push_back(View(frame));
+            CheckFrame(views.back());
+        }
+        if (views.size() < 2) {
+            throw std::invalid_argument("EstimateBatch needs at least two frames");
+        }
+        ssize_t pairs = views.size() - 1;
+        ssize_t cells_per_block = getBlockSize() / getMinBlockSize();
+        ssize_t rows = cells_per_block * getBlocksPerColumn(), columns = cells_per_block * getBlocksPerRow();
+        py::array_t<int16_t> dy({pairs, rows, columns});
+        py::array_t<int16_t> dx({pairs, rows, columns});
+        py::array_t<int32_t> cost({pairs, rows, columns});
+        py::array_t<uint8_t> phase({pairs, rows, columns});
+        py::array_t<uint8_t> reference({pairs, rows, columns});
+        py::array_t<uint8_t> depth({pairs, rows, columns});
+        py::array_t<uint8_t> split({pairs, ssize_t(getBlocksPerColumn()), ssize_t(getBlocksPerRow())});
+        int16_t* dy_ptr = dy.mutable_data();
+        int16_t* dx_ptr = dx.mutable_data();
+        int32_t* cost_ptr = cost.mutable_data();
+        uint8_t* phase_ptr = phase.mutable_data();
+        uint8_t* reference_ptr = reference.mutable_data();
+        uint8_t* depth_ptr = depth.mutable_data();
+        uint8_t* split_ptr = split.mutable_data();
+        {
+            py::gil_scoped_release release;
+            MotionEstimator::EstimateBatch(views, [&](int pair, const MotionField& field) {
+                size_t cells = field._dy.size(), blocks = field._split.size();
+                std::copy(field._dy.begin(), field._dy.end(), dy_ptr + pair * cells);
+                std::copy(field._dx.begin(), field._dx.end(), dx_ptr + pair * cells);
+                std::copy(field._cost.begin(), field._cost.end(), cost_ptr + pair * cells);
+                std::copy(field._phase.begin(), field._phase.end(), phase_ptr + pair * cells);
+                std::copy(field._reference.begin(), field._reference.end(), reference_ptr + pair * cells);
+                std::copy(field._depth.begin(), field._depth.end(), depth_ptr + pair * cells);
+                std::copy(field._split.begin(), field._split.end(), split_ptr + pair * blocks);
+            });
+        }
+        py::dict result;
+        result["dy"] = dy;
+        result["dx"] = dx;
+        result["cost"] = cost;
+        result["phase"] = phase;
+        result["reference"] = reference;
+        result["depth"] = depth;
+        result["split"] = split;
+        return result;
+    };
+    // Motion-compensated reference of the last Estimate. Written into `out`
+    // if it is given, a height x width C-contiguous uint8 array, so that
+    // one buffer can be reused for every frame.
+    py::array_t<unsigned char> Remap(py::array_t<unsigned char> previous_frame, py::object out) {
+        py::array_t<unsigned char> result = GetOutputFrame(out);
+        unsigned char* result_ptr = result.mutable_data();
+        ptrdiff_t stride = result.strides(0);
+        {
+            py::gil_scoped_release release;
+            MotionEstimator::Remap(result_ptr, stride);
+        }
+        return result;
+    };
+    // Remap plus the QualityMetrics of the result against the current
+    // frame, returns (frame, metrics)
+    py::tuple RemapWithMetrics(py::array_t<unsigned char> previous_frame, FrameArray current_frame, py::object out) {
+        FrameView current = View(current_frame);
+        CheckFrame(current);
+        py::array_t<unsigned char> result = GetOutputFrame(out);
+        unsigned char* result_ptr = result.mutable_data();
+        ptrdiff_t stride = result.strides(0);
+        QualityMetrics metrics;
+        {
+            py::gil_scoped_release release;
+            metrics = MotionEstimator::Remap(result_ptr, stride, current);
+        }
+        return py::make_tuple(result, metrics);
+    };
+    // Bi-predicted frame of the last EstimateBidirectional, written into
+    // `out` like Remap
+    py::array_t<unsigned char> RemapBidirectional(py::object out) {
+        py::array_t<unsigned char> result = GetOutputFrame(out);
+        unsigned char* result_ptr = result.mutable_data();
+        ptrdiff_t stride = result.strides(0);
+        {
+            py::gil_scoped_release release;
+            MotionEstimator::RemapBidirectional(result_ptr, stride);
+        }
+        return result;
+    };
+    py::tuple RemapBidirectionalWithMetrics(FrameArray current_frame, py::object out) {
+        FrameView current = View(current_frame);
+        CheckFrame(current);
+        py::array_t<unsigned char> result = GetOutputFrame(out);
+        unsigned char* result_ptr = result.mutable_data();
+        ptrdiff_t stride = result.strides(0);
+        QualityMetrics metrics;
+        {
+            py::gil_scoped_release release;
+            metrics = MotionEstimator::RemapBidirectional(result_ptr, stride, current);
+        }
+        return py::make_tuple(result, metrics);
+    };
+    // 4:2:0 frames packed like OpenCV does, (height * 3 / 2) x width arrays
+    // with the luma rows followed by the chroma: the U plane, then the V
+    // plane for "I420", interleaved UV rows for "NV12". The field comes from
+    // the luma alone, like in Estimate.
+    py::dict EstimateYuv(FrameArray previous_frame, FrameArray current_frame, const std::string& layout) {
+        if (layout != "I420" && layout != "NV12") {
+            throw std::invalid_argument("layout has to be \"I420\" or \"NV12\"");
+        }
+        bool nv12 = layout == "NV12";
+        YuvFrameView previous = PackedYuv(previous_frame, nv12), current = PackedYuv(current_frame, nv12);
+        py::object pinned = previous_frame;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(getMutex());
+            EstimateFrame(previous, current);
+            std::swap(this -> _reference_frame, pinned);
+        }
+        this -> _nv12 = nv12;
+        return GetMotionField();
+    };
+    // All three planes compensated, packed in the layout of the last
+    // EstimateYuv. Written into `out` like Remap.
+    py::array_t<unsigned char> RemapYuv(py::object out) {
+        py::array_t<unsigned char> result = GetOutputFrame(out, PackedHeight());
+        YuvOutputView view = PackedYuv(result.mutable_data(), _nv12);
+        {
+            py::gil_scoped_release release;
+            MotionEstimator::Remap(view);
+        }
+        return result;
+    };
+    // Blocks to estimate as a blocks-per-column x blocks-per-row array,
+    // nonzero entries are estimated. None estimates every block.
+    void SetRegionOfInterest(py::object mask) {
+        std::vector<uint8_t> blocks;
+        if (!mask.is_none()) {
+            auto array = mask.cast<py::array_t<uint8_t, py::array::c_style | py::array::forcecast>>();
+            if (array.ndim() != 2 || array.shape(0) != getBlocksPerColumn() || array.shape(1) != getBlocksPerRow()) {
+                throw std::invalid_argument(
+                    "mask has to be " + std::to_string(getBlocksPerColumn()) + "x" + std::to_string(getBlocksPerRow())
+                );
+            }
+            blocks.assign(array.data(), array.data() + array.size());
+        }
+        setRegionOfInterest(blocks);
+    };
+    // Counters and phase times of the last Estimate, plus the evaluations
+    // per block as "effort" if the effort map is on
+    py::dict GetStats() {
+        std::lock_guard<std::mutex> lock(getMutex());
+        const FrameStats& stats = getFrameStats();
+        py::dict result;
+        result["evaluations"] = stats.search.evaluations;
+        result["reused"] = stats.search.reused;
+        result["terminated"] = stats.search.terminated;
+        result["static_hits"] = stats.search.static_hits;
+        result["splits"] = stats.search.splits;
+        result["reference_searches"] = stats.search.reference_searches;
+        result["unchanged"] = stats.search.unchanged;
+        result["max_depth"] = stats.search.max_depth;
+        result["subpel_ms"] = stats.subpel_ms;
+        result["pyramid_ms"] = stats.pyramid_ms;
+        result["search_ms"] = stats.search_ms;
+        result["remap_ms"] = stats.remap_ms;
+        const std::vector<uint32_t>& effort = getEffortMap();
+        if (!effort.empty()) {
+            // A copy, the map is rewritten by every Estimate
+            py::array_t<uint32_t> effort_array({getBlocksPerColumn(), getBlocksPerRow()});
+            std::copy(effort.begin(), effort.end(), effort_array.mutable_data());
+            result["effort"] = effort_array;
+        }
+        return result;
+    };
+private:
+    // Views of `field`, see GetMotionField
+    py::dict FieldViews(const MotionField& field) {
+        // The estimator is the base object of every view. If Python does not
+        // own it already, the reference policy keeps Python from deleting it.
+        py::object owner = py::cast(this, py::return_value_policy::reference);
+        std::vector<ssize_t> shape{field.getRows(), field.getColumns()};
+        std::vector<ssize_t> block_shape{getBlocksPerColumn(), getBlocksPerRow()};
+        py::dict result;
+        result["dy"] = FieldView(field._dy, shape, owner);
+        result["dx"] = FieldView(field._dx, shape, owner);
+        result["cost"] = FieldView(field._cost, shape, owner);
+        result["phase"] = FieldView(field._phase, shape, owner);
+        result["reference"] = FieldView(field._reference, shape, owner);
+        result["depth"] = FieldView(field._depth, shape, owner);
+        result["split"] = FieldView(field._split, block_shape, owner);
+        return result;
+    };
+    template<typename T>
+    static py::array_t<T> FieldView(const std::vector<T>& values, const std::vector<ssize_t>& shape, py::object owner) {
+        return py::array_t<T>(shape, {shape[1] * ssize_t(sizeof(T)), ssize_t(sizeof(T))}, values.data(), owner);
+    };
+    // Rows of a packed 4:2:0 frame, only even frame sizes pack evenly
+    int PackedHeight() const {
+        if (getHeight() % 2 != 0 || getWidth() % 2 != 0) {
+            throw std::invalid_argument("Packed YUV frames need an even frame size");
+        }
+        return getHeight() * 3 / 2;
+    };
+    YuvFrameView PackedYuv(const FrameArray& frame, bool nv12) const {
+        if (frame.ndim() != 2 || frame.shape(0) != PackedHeight() || frame.shape(1) != getWidth()) {
+            throw std::invalid_argument("YUV frames have to be " + std::to_string(PackedHeight()) + "x" + std::to_string(getWidth()));
+        }
+        return PackedYuv(frame.data(), nv12);
+    };
+    template<typename Pixel>
+    YuvView<Pixel> PackedYuv(Pixel* data, bool nv12) const {
+        Pixel* chroma = data + getHeight() * getWidth();
+        if (nv12) {
+            return YuvView<Pixel>::NV12(data, getWidth(), chroma, getWidth());
+        }
+        int chroma_size = getChromaHeight() * getChromaWidth();
+        return YuvView<Pixel>::Planar(data, getWidth(), chroma, chroma + chroma_size, getChromaWidth());
+    };
+    // `out` checked for Remap, or a new frame if it is None. Frames have
+    // `height` rows, more than the picture for packed YUV.
+    py::array_t<unsigned char> GetOutputFrame(py::object out, int height) const {
+        if (out.is_none()) {
+            return py::array_t<unsigned char>({height, getWidth()});
+        }
+        // Written in place, so it has to be usable without any conversion
+        if (!py::isinstance<py::array_t<unsigned char, py::array::c_style>>(out)) {
+            throw std::invalid_argument("out has to be a C-contiguous uint8 array");
+        }
+        py::array_t<unsigned char> result = out.cast<py::array_t<unsigned char>>();
+        if (result.ndim() != 2 || result.shape(0) != height || result.shape(1) != getWidth()) {
+            throw std::invalid_argument("out has to be " + std::to_string(height) + "x" + std::to_string(getWidth()));
+        }
+        return result;
+    };
+    py::array_t<unsigned char> GetOutputFrame(py::object out) const {
+        return GetOutputFrame(out, getHeight());
+    };
+
+    // Reference frame of the last Estimate, the planes of the estimator may
+    // point into it. Swapped under the estimator mutex, only ever released
+    // with the GIL held.
+    py::object _reference_frame;
+    // Layout of the last EstimateYuv
+    bool _nv12 = false;
+};
+
+// The setters take a one-element int array, like they always did
+template<auto setter>
+void SetFromArray(PyMotionEstimator& estimator, py::array_t<int> value) {
+    (estimator.*setter)(*(int*)value.request().ptr);
+}
+
 PYBIND11_MODULE(me_estimator, m) {
-    py::class_<MotionEstimator>(m, "MotionEstimator")
-        .def(py::init<size_t, size_t, size_t, bool>())
-        .def("Estimate", &MotionEstimator::Estimate)
-        .def("Remap", &MotionEstimator::Remap)
-        .def("AssignBlock", &MotionEstimator::AssignBlock)
-        .def("set_SearchMethod", &MotionEstimator::set_SearchMethod)
-        .def("set_CrossSearch_ErrorThreshold", &MotionEstimator::set_CrossSearch_ErrorThreshold)
-        .def("set_CrossSearch_Side", &MotionEstimator::set_CrossSearch_Side);
+    py::class_<PyMotionEstimator>(m, "MotionEstimator")
+        .def(py::init<int, int, int, bool, int, int>(),
+            py::arg("width"), py::arg("height"), py::arg("quality"), py::arg("use_halfpixel"),
+            py::arg("block_size") = 16, py::arg("min_block_size") = 8)
+        .def("Estimate", &PyMotionEstimator::Estimate)
+        .def("GetMotionField", &PyMotionEstimator::GetMotionField)
+        .def("EstimateBatch", &PyMotionEstimator::EstimateBatch)
+        .def("EstimateBidirectional", &PyMotionEstimator::EstimateBidirectional)
+        .def("EstimateYuv", &PyMotionEstimator::EstimateYuv,
+             py::arg("previous_frame"), py::arg("current_frame"), py::arg("layout") = "I420")
+        .def("Remap", &PyMotionEstimator::Remap, py::arg("previous_frame"), py::arg("out") = py::none())
+        .def("RemapWithMetrics", &PyMotionEstimator::RemapWithMetrics,
+             py::arg("previous_frame"), py::arg("current_frame"), py::arg("out") = py::none())
+        .def("RemapBidirectional", &PyMotionEstimator::RemapBidirectional, py::arg("out") = py::none())
+        .def("RemapBidirectionalWithMetrics", &PyMotionEstimator::RemapBidirectionalWithMetrics,
+             py::arg("current_frame"), py::arg("out") = py::none())
+        .def("RemapYuv", &PyMotionEstimator::RemapYuv, py::arg("out") = py::none())
+        .def("get_EvaluationCount", &MotionEstimator::get_EvaluationCount)
+        .def("GetStats", &PyMotionEstimator::GetStats)
+        .def("set_SearchMethod", &SetFromArray<&MotionEstimator::setSearchMethod>)
+        .def("set_ThreadCount", &SetFromArray<&MotionEstimator::setThreadCount>)
+        .def("set_PyramidLevels", &SetFromArray<&MotionEstimator::setPyramidLevels>)
+        .def("set_SuccessiveElimination", &SetFromArray<&MotionEstimator::setSuccessiveElimination>)
+        .def("set_BorderExtension", &SetFromArray<&MotionEstimator::setBorderExtension>)
+        .def("set_LazyHalfpel", &SetFromArray<&MotionEstimator::setLazyHalfpel>)
+        .def("set_VisitedCache", &SetFromArray<&MotionEstimator::setVisitedCache>)
+        .def("set_EffortMap", &SetFromArray<&MotionEstimator::setEffortMap>)
+        .def("set_SplitShare", &SetFromArray<&MotionEstimator::setSplitShare>)
+        .def("set_ReferenceCount", &SetFromArray<&MotionEstimator::setReferenceCount>)
+        .def("set_ReferenceThreshold", &SetFromArray<&MotionEstimator::setReferenceThreshold>)
+        .def("set_ChangeDetection", &SetFromArray<&MotionEstimator::setChangeDetection>)
+        .def("set_RegionOfInterest", &PyMotionEstimator::SetRegionOfInterest, py::arg("mask"))
+        .def("set_CrossSearch_ErrorThreshold", &SetFromArray<&MotionEstimator::setCrossSearchErrorThreshold>)
+        .def("set_CrossSearch_Side", &SetFromArray<&MotionEstimator::setCrossSearchSide>);
+    // The distortion kernels alone, for checking the SIMD levels against
+    // each other. The rank block is the top-left block of `rank`.
+    m.def("detect_simd_level", [] { return int(detect_simd_level()); });
+    m.def("select_distortion_kernels", [](int level) {
+        if (level < int(SimdLevel::Scalar) || level > int(SimdLevel::AVX512)) {
+            throw std::invalid_argument("SIMD level must be in [0, 3]");
+        }
+        return int(select_distortion_kernels(SimdLevel(level)));
+    });
+    m.def("block_ssd", [](FrameArray domain, int h, int w, FrameArray rank, int block_size, int error) {
+        return block_ssd(BlockAt(domain, h, w, block_size), domain.strides(0), BlockAt(rank, 0, 0, block_size), rank.strides(0), block_size, error);
+    }, py::arg("domain"), py::arg("h"), py::arg("w"), py::arg("rank"), py::arg("block_size"), py::arg("error") = std::numeric_limits<int>::max());
+    m.def("block_sad", [](FrameArray domain, int h, int w, FrameArray rank, int block_size, int error) {
+        return block_sad(BlockAt(domain, h, w, block_size), domain.strides(0), BlockAt(rank, 0, 0, block_size), rank.strides(0), block_size, error);
+    }, py::arg("domain"), py::arg("h"), py::arg("w"), py::arg("rank"), py::arg("block_size"), py::arg("error") = std::numeric_limits<int>::max());
+    m.def("block_ssd_batch", [](FrameArray domain, const std::vector<std::pair<int, int>>& offsets, FrameArray rank, int block_size, int error) {
+        std::vector<const unsigned char*> domains;
+        for (const auto& offset : offsets) {
+            domains.push_back(BlockAt(domain, offset.first, offset.second, block_size));
+        }
+        std::vector<int> costs(domains.size());
+        block_ssd_batch(domains.data(), int(domains.size()), domain.strides(0), BlockAt(rank, 0, 0, block_size), rank.strides(0), block_size, costs.data(), error);
+        return costs;
+    }, py::arg("domain"), py::arg("offsets"), py::arg("rank"), py::arg("block_size"), py::arg("error") = std::numeric_limits<int>::max());
     py::class_<Matrix>(m, "Matrix")
         .def(py::init<unsigned char*, size_t, size_t>())
         .def("getHeight", &Matrix::getHeight)
@@ -28,4 +411,23 @@ PYBIND11_MODULE(me_estimator, m) {
         .def("getError", &MotionVector::getError)
         .def("is_splitted", &MotionVector::is_splitted)
         .def("getSubvectors", &MotionVector::getSubvectors);
-};
\ No newline at end of file
+    py::class_<QualityMetrics>(m, "QualityMetrics")
+        .def_readonly("sad", &QualityMetrics::sad)
+        .def_readonly("mse", &QualityMetrics::mse)
+        .def_readonly("psnr", &QualityMetrics::psnr)
+        .def_readonly("ssim", &QualityMetrics::ssim);
+    py::class_<PipelineStats>(m, "PipelineStats")
+        .def_readonly("frames", &PipelineStats::frames)
+        .def_readonly("read_seconds", &PipelineStats::read_seconds)
+        .def_readonly("estimate_seconds", &PipelineStats::estimate_seconds)
+        .def_readonly("write_seconds", &PipelineStats::write_seconds)
+        .def_readonly("total_seconds", &PipelineStats::total_seconds);
+    // The whole clip is processed natively, other Python threads keep running
+    py::class_<VideoPipeline>(m, "VideoPipeline")
+        .def(py::init([](PyMotionEstimator& estimator, int ring_size) {
+                 return new VideoPipeline(estimator, ring_size);
+             }), py::keep_alive<1, 2>(),
+             py::arg("estimator"), py::arg("ring_size") = 4)
+        .def("Run", &VideoPipeline::Run, py::call_guard<py::gil_scoped_release>(),
+             py::arg("input_path"), py::arg("vectors_path"), py::arg("frames_path") = "", py::arg("max_frames") = -1);
+};
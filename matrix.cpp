@@ -3,8 +3,57 @@
 Matrix::Matrix(unsigned char* vector,
                int height,
                int width) :
-               _vector(vector),
                _height(height),
-               _width(width) {
+               _width(width),
+               _stride(width),
+               _border(0),
+               _vector(vector) {
                    this -> _total = height * width;
                }
+
+Matrix::Matrix(unsigned char* vector,
+               int height,
+               int width,
+               int stride,
+               int border) :
+               _height(height),
+               _width(width),
+               _stride(stride),
+               _border(border),
+               _vector(vector + border * stride + border) {
+                   this -> _total = height * width;
+               }
+
+void IntegralImage::Build(const Matrix& frame, bool with_squares) {
+    // The tables cover the border too, so candidates outside of the picture
+    // can be eliminated as well
+    int border = frame.getBorder();
+    int height = frame.getHeight() + 2 * border;
+    int width = frame.getWidth() + 2 * border;
+    this -> _border = border;
+    this -> _table_width = width + 1;
+    this -> _sum.assign(size_t(height + 1) * _table_width, 0);
+    for (int h = 0; h < height; h++) {
+        const unsigned char* row = frame.ptr(h - border, -border);
+        uint32_t* sum = _sum.data() + (h + 1) * _table_width;
+        uint32_t row_sum = 0;
+        for (int w = 0; w < width; w++) {
+            row_sum += row[w];
+            sum[w + 1] = sum[w + 1 - _table_width] + row_sum;
+        }
+    }
+    if (!with_squares) {
+        this -> _square_sum.clear();
+        return;
+    }
+    this -> _square_sum.assign(size_t(height + 1) * _table_width, 0);
+    for (int h = 0; h < height; h++) {
+        const unsigned char* row = frame.ptr(h - border, -border);
+        uint64_t* square_sum = _square_sum.data() + (h + 1) * _table_width;
+        uint64_t row_square_sum = 0;
+        for (int w = 0; w < width; w++) {
+            row_square_sum += int(row[w]) * row[w];
+            square_sum[w + 1] = square_sum[w + 1 - _table_width] + row_square_sum;
+        }
+    }
+}
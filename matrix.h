@@ -1,12 +1,59 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 #include "MotionVector.h"
 
+class Matrix;
+class HalfpelTiles;
+
+// Integral images (summed-area tables) of the pixels and of their squares,
+// every rectangle sum costs four lookups. Used for successive elimination.
+class IntegralImage {
+public:
+    // The table of squares is only needed for the MSEA bound
+    void Build(const Matrix& frame, bool with_squares);
+
+    // Coordinates are relative to the picture origin and may reach into the
+    // border of a padded frame. Wraps around modulo 2^32, which cancels out as
+    // long as the rectangle itself sums to less than 2^32.
+    int Sum(int h, int w, int height, int width) const {
+        return int(Rectangle(_sum, h, w, height, width));
+    };
+    int64_t SquareSum(int h, int w, int height, int width) const {
+        return int64_t(Rectangle(_square_sum, h, w, height, width));
+    };
+    // Sums of the four quadrants of a square block, in row-major order. Nine
+    // lookups instead of sixteen, the quadrants share their corners.
+    void QuadrantSums(int h, int w, int block_size, int* sums) const {
+        int half = block_size >> 1;
+        const uint32_t* top = _sum.data() + (h + _border) * _table_width + w + _border;
+        const uint32_t* middle = top + half * _table_width;
+        const uint32_t* bottom = middle + half * _table_width;
+        sums[0] = int(middle[half] - middle[0] - top[half] + top[0]);
+        sums[1] = int(middle[block_size] - middle[half] - top[block_size] + top[half]);
+        sums[2] = int(bottom[half] - bottom[0] - middle[half] + middle[0]);
+        sums[3] = int(bottom[block_size] - bottom[half] - middle[block_size] + middle[half]);
+    };
+private:
+    template<typename T>
+    T Rectangle(const std::vector<T>& table, int h, int w, int height, int width) const {
+        const T* top = table.data() + (h + _border) * _table_width + w + _border;
+        const T* bottom = top + height * _table_width;
+        return bottom[width] - bottom[0] - top[width] + top[0];
+    };
+    // One zero row and column in front of the frame and its border
+    int _table_width;
+    int _border;
+    std::vector<uint32_t> _sum;
+    std::vector<uint64_t> _square_sum;
+};
+
 class Matrix {
 public:
     Matrix(
@@ -14,6 +61,15 @@ public:
         int height,
         int width
     );
+    // Picture of height x width whose top-left pixel is `border` rows and
+    // columns into `vector`. Blocks may be read up to `border` pixels outside.
+    Matrix(
+        unsigned char* vector,
+        int height,
+        int width,
+        int stride,
+        int border
+    );
     // ISO CPP tells us that if we define function inside the class, eventually
     // compiler makes it inline
     int getHeight() const  {
@@ -23,12 +79,51 @@ public:
         return this -> _width;;
     };
 
-    int get(size_t h, size_t w) const {
-        return static_cast<int>(_vector[h * getWidth() + w]);
+    int getStride() const {
+        return this -> _stride;
+    };
+
+    int getBorder() const {
+        return this -> _border;
+    };
+
+    // True if the block at (h, w) can be read, border included
+    bool isInside(int h, int w, int block_size) const {
+        return h >= -_border && h + block_size <= _height + _border &&
+               w >= -_border && w + block_size <= _width + _border;
+    };
+
+    int get(int h, int w) const {
+        return static_cast<int>(_vector[h * getStride() + w]);
+    };
+    // Raw access for the SIMD kernels, rows are getStride() bytes apart
+    const unsigned char* ptr(int h, int w) const {
+        return _vector + h * getStride() + w;
+    };
+
+    // Block sums of this frame, nullptr if they were not computed
+    const IntegralImage* getSums() const {
+        return this -> _sums;
+    };
+    void setSums(const IntegralImage* sums) {
+        this -> _sums = sums;
+    };
+    // Set on half-pixel planes that are interpolated on demand, blocks have
+    // to be passed to Ensure before they are read
+    const HalfpelTiles* getTiles() const {
+        return this -> _tiles;
+    };
+    void setTiles(const HalfpelTiles* tiles) {
+        this -> _tiles = tiles;
     };
 private:
     int _height;
     int _width;
     int _total;
+    int _stride;
+    int _border;
+    // Points at the picture origin, not at the start of the border
     unsigned char* _vector;
+    const IntegralImage* _sums = nullptr;
+    const HalfpelTiles* _tiles = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "motion_field.h"
+
+#include <algorithm>
+
+void MotionField::Resize(int blocks_per_column, int blocks_per_row, int block_size, int cell_size) {
+    this -> _cells_per_block = block_size / cell_size;
+    this -> _rows = _cells_per_block * blocks_per_column;
+    this -> _columns = _cells_per_block * blocks_per_row;
+    this -> _block_size = block_size;
+    this -> _cell_size = cell_size;
+    size_t cells = size_t(_rows) * _columns;
+    this -> _dy.assign(cells, 0);
+    this -> _dx.assign(cells, 0);
+    this -> _cost.assign(cells, 0);
+    this -> _phase.assign(cells, 0);
+    this -> _reference.assign(cells, 0);
+    this -> _depth.assign(cells, 0);
+    this -> _split.assign(size_t(blocks_per_column) * blocks_per_row, 0);
+}
+
+void MotionField::Store(int row, int column, const MotionVector& motion_vector) {
+    int first = Cell(row, column);
+    int16_t dy = int16_t(motion_vector._h - row * _block_size);
+    int16_t dx = int16_t(motion_vector._w - column * _block_size);
+    this -> _split[row * (_columns / _cells_per_block) + column] = 0;
+    for (int cell_row = 0; cell_row < _cells_per_block; cell_row++) {
+        int cell = first + cell_row * _columns;
+        std::fill_n(_dy.begin() + cell, _cells_per_block, dy);
+        std::fill_n(_dx.begin() + cell, _cells_per_block, dx);
+        std::fill_n(_cost.begin() + cell, _cells_per_block, motion_vector._error);
+        std::fill_n(_phase.begin() + cell, _cells_per_block, uint8_t(motion_vector.shift_dir));
+        std::fill_n(_reference.begin() + cell, _cells_per_block, uint8_t(motion_vector.reference));
+        std::fill_n(_depth.begin() + cell, _cells_per_block, 0);
+    }
+}
+
+void MotionField::Store(int row, int column, const BlockPartition& partition) {
+    int first = Cell(row, column);
+    this -> _split[row * (_columns / _cells_per_block) + column] = 1;
+    for (int cell_row = 0; cell_row < _cells_per_block; cell_row++) {
+        int cell = first + cell_row * _columns;
+        int source = cell_row * _cells_per_block;
+        std::copy_n(partition._dy.begin() + source, _cells_per_block, _dy.begin() + cell);
+        std::copy_n(partition._dx.begin() + source, _cells_per_block, _dx.begin() + cell);
+        std::copy_n(partition._cost.begin() + source, _cells_per_block, _cost.begin() + cell);
+        std::copy_n(partition._phase.begin() + source, _cells_per_block, _phase.begin() + cell);
+        std::copy_n(partition._reference.begin() + source, _cells_per_block, _reference.begin() + cell);
+        std::copy_n(partition._depth.begin() + source, _cells_per_block, _depth.begin() + cell);
+    }
+}
+
+void BlockPartition::Reset(int h, int w, int block_size, int cell_size) {
+    this -> _h = h;
+    this -> _w = w;
+    this -> _block_size = block_size;
+    this -> _cell_size = cell_size;
+    this -> _cells_per_block = block_size / cell_size;
+    // Only allocates for the first block
+    size_t cells = size_t(_cells_per_block) * _cells_per_block;
+    this -> _dy.resize(cells);
+    this -> _dx.resize(cells);
+    this -> _cost.resize(cells);
+    this -> _phase.resize(cells);
+    this -> _reference.resize(cells);
+    this -> _depth.resize(cells);
+}
+
+void BlockPartition::Store(int h, int w, int size, const MotionVector& leaf) {
+    int first_row = (h - _h) / _cell_size, first_column = (w - _w) / _cell_size;
+    int cells = size / _cell_size;
+    uint8_t depth = uint8_t(__builtin_ctz(_block_size) - __builtin_ctz(size));
+    for (int cell_row = first_row; cell_row < first_row + cells; cell_row++) {
+        int cell = cell_row * _cells_per_block + first_column;
+        std::fill_n(_dy.begin() + cell, cells, int16_t(leaf._h - h));
+        std::fill_n(_dx.begin() + cell, cells, int16_t(leaf._w - w));
+        std::fill_n(_cost.begin() + cell, cells, leaf._error);
+        std::fill_n(_phase.begin() + cell, cells, uint8_t(leaf.shift_dir));
+        std::fill_n(_depth.begin() + cell, cells, depth);
+    }
+}
+
+void BlockPartition::SetPlane(int reference, int phase) {
+    std::fill(_reference.begin(), _reference.end(), uint8_t(reference));
+    std::fill(_phase.begin(), _phase.end(), uint8_t(phase));
+}
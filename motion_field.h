@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "MotionVector.h"
+
+class BlockPartition;
+
+// Motion field of one frame in structure-of-arrays form. The frame is
+// covered by a grid of cells of the smallest block size and every block owns
+// the square of cells under it. A block is a quad-tree of leaves, every leaf
+// writes its vector into all cells under it, so each array reads as a dense
+// row-major field of getRows() x getColumns() cells whatever the partition.
+class MotionField {
+public:
+    void Resize(int blocks_per_column, int blocks_per_row, int block_size, int cell_size);
+
+    // Stores the search result of an unsplit block at (row, column)
+    void Store(int row, int column, const MotionVector& motion_vector);
+    // Stores the leaves of a split block
+    void Store(int row, int column, const BlockPartition& partition);
+
+    int getRows() const {
+        return this -> _rows;
+    };
+    int getColumns() const {
+        return this -> _columns;
+    };
+    int getBlockSize() const {
+        return this -> _block_size;
+    };
+    int getCellSize() const {
+        return this -> _cell_size;
+    };
+    // Cells along one side of a block
+    int getCellsPerBlock() const {
+        return this -> _cells_per_block;
+    };
+    // First cell of the block at (row, column), the others follow row by
+    // row, getColumns() apart
+    int Cell(int row, int column) const {
+        return _cells_per_block * (row * _columns + column);
+    };
+
+    // Displacement of the cell in the reference frame, in pixels
+    std::vector<int16_t> _dy;
+    std::vector<int16_t> _dx;
+    // Error of the leaf the cell belongs to
+    std::vector<int32_t> _cost;
+    // Half-pixel plane: 0 - none, 1 - up, 2 - left, 3 - up-left
+    std::vector<uint8_t> _phase;
+    // Reference frame: 0 - the previous frame, i - the one i frames earlier
+    std::vector<uint8_t> _reference;
+    // Splits between the block and the leaf of the cell, the leaf is
+    // getBlockSize() >> depth pixels wide
+    std::vector<uint8_t> _depth;
+    // One flag per block, set if any of its leaves is smaller than the block
+    std::vector<uint8_t> _split;
+private:
+    int _rows = 0;
+    int _columns = 0;
+    int _block_size = 0;
+    int _cell_size = 0;
+    int _cells_per_block = 0;
+};
+
+// Leaves of the quad-tree of one block, on the cell grid of MotionField.
+// The split searches write the leaves of a split here, a split that loses
+// is simply overwritten by the leaf of its parent.
+class BlockPartition {
+public:
+    // Starts the block whose top-left pixel is (h, w)
+    void Reset(int h, int w, int block_size, int cell_size);
+    // Leaf of `size` pixels at (h, w) in picture coordinates, the vector
+    // is absolute like in MotionVector
+    void Store(int h, int w, int size, const MotionVector& leaf);
+    // Puts every leaf into one half-pixel plane of one reference
+    void SetPlane(int reference, int phase);
+
+    int getCellsPerBlock() const {
+        return this -> _cells_per_block;
+    };
+
+    // Row-major cells of the block, laid out like in MotionField
+    std::vector<int16_t> _dy;
+    std::vector<int16_t> _dx;
+    std::vector<int32_t> _cost;
+    std::vector<uint8_t> _phase;
+    std::vector<uint8_t> _reference;
+    std::vector<uint8_t> _depth;
+private:
+    int _h = 0;
+    int _w = 0;
+    int _block_size = 0;
+    int _cell_size = 0;
+    int _cells_per_block = 0;
+};
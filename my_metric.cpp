@@ -1,30 +1,636 @@
 #include "my_metric.h"
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ME_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
 int compute_abs_difference(
-    const Matrix& domain, 
+    const Matrix& domain,
     int domain_h,
     int domain_w,
     const Matrix& rank,
     int rank_h,
     int rank_w,
-    int block_size, 
+    int block_size,
     int error
 )  {
-    // Rank blocks are always under control, so just check if domain 
+    // Rank blocks are always under control, so just check if domain
     // block lays inside the picture.
-    if (domain_h < 0 || domain_h + block_size >= domain.getHeight() + 1 || 
-        domain_w < 0 || domain_w + block_size >= domain.getWidth() + 1) 
+    if (domain_h < 0 || domain_h + block_size >= domain.getHeight() + 1 ||
+        domain_w < 0 || domain_w + block_size >= domain.getWidth() + 1)
     {
            return std::numeric_limits<int>::max();
     }
+    return block_sad(
+        domain.ptr(domain_h, domain_w),
+        domain.getStride(),
+        rank.ptr(rank_h, rank_w),
+        rank.getStride(),
+        block_size,
+        error
+    );
+}
+
+namespace {
+
+constexpr int kTerminated = std::numeric_limits<int>::max();
+
+// Reference implementations, every SIMD kernel has to match them bit for bit.
+int ssd_scalar(
+    const unsigned char* domain,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error
+) {
     int sum = 0;
-    for (int h = 0; h < block_size; h++) {
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
         for (int w = 0; w < block_size; w++) {
-            sum += std::abs(domain.get(h + domain_h, w + domain_w) - rank.get(h + rank_h, w + rank_w)); 
-            if (sum >= error) {
-                return std::numeric_limits<int>::max();
-            }
+            int value = int(domain[w]) - rank[w];
+            sum += value * value;
+        }
+        // Every term is non-negative, so checking once per row terminates
+        // exactly when the per-pixel check would.
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+int sad_scalar(
+    const unsigned char* domain,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        for (int w = 0; w < block_size; w++) {
+            sum += std::abs(int(domain[w]) - rank[w]);
+        }
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+// Used for the widths that have no dedicated batch kernel
+void ssd_batch_generic(
+    const unsigned char* const* domains,
+    int count,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error,
+    int* costs
+) {
+    BlockDistortionKernel kernel = distortion_kernels().ssd[KernelWidth(block_size)];
+    for (int i = 0; i < count; i++) {
+        costs[i] = kernel(domains[i], domain_stride, rank, rank_stride, block_size, error);
+    }
+}
+
+#ifdef ME_X86_KERNELS
+
+#define ME_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define ME_TARGET_AVX2 __attribute__((target("avx2")))
+#define ME_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+ME_TARGET_SSE41 inline int hsum_epi32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+ME_TARGET_SSE41 inline int hsum_sad(__m128i v) {
+    return _mm_cvtsi128_si32(_mm_add_epi64(v, _mm_unpackhi_epi64(v, v)));
+}
+
+ME_TARGET_SSE41 inline __m128i load4(const unsigned char* p) {
+    int32_t value;
+    memcpy(&value, p, sizeof(value));
+    return _mm_cvtsi32_si128(value);
+}
+
+// Squared differences of 8 pixels, widened to 16 bit. madd of two squares
+// fits easily: 2 * 255^2 < 2^31.
+ME_TARGET_SSE41 inline __m128i ssd8_sse41(__m128i a, __m128i b) {
+    __m128i diff = _mm_sub_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+    return _mm_madd_epi16(diff, diff);
+}
+
+ME_TARGET_SSE41 int ssd_4_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        sum += hsum_epi32(ssd8_sse41(load4(domain), load4(rank)));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_SSE41 int ssd_8_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain));
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rank));
+        sum += hsum_epi32(ssd8_sse41(a, b));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_SSE41 int ssd_16_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m128i acc = _mm_setzero_si128();
+        for (int w = 0; w < block_size; w += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(domain + w));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + w));
+            acc = _mm_add_epi32(acc, ssd8_sse41(a, b));
+            acc = _mm_add_epi32(acc, ssd8_sse41(_mm_srli_si128(a, 8), _mm_srli_si128(b, 8)));
+        }
+        sum += hsum_epi32(acc);
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_SSE41 int sad_4_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        sum += _mm_cvtsi128_si32(_mm_sad_epu8(load4(domain), load4(rank)));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_SSE41 int sad_8_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain));
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rank));
+        sum += _mm_cvtsi128_si32(_mm_sad_epu8(a, b));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_SSE41 int sad_16_sse41(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m128i acc = _mm_setzero_si128();
+        for (int w = 0; w < block_size; w += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(domain + w));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + w));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(a, b));
+        }
+        sum += hsum_sad(acc);
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_AVX2 inline int hsum_epi32_avx2(__m256i v) {
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(half);
+}
+
+// A 16 pixel row widened to 16 bit fills a whole ymm register.
+ME_TARGET_AVX2 int ssd_16_avx2(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int w = 0; w < block_size; w += 16) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(domain + w)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + w)));
+            __m256i diff = _mm256_sub_epi16(a, b);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+        }
+        sum += hsum_epi32_avx2(acc);
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+// Two 8 pixel rows per register, the halves are reduced one after another to
+// keep the per-row termination check.
+ME_TARGET_AVX2 int ssd_8_avx2(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    int sum = 0;
+    for (int h = 0; h < block_size; h += 2, domain += 2 * domain_stride, rank += 2 * rank_stride) {
+        __m128i a = _mm_unpacklo_epi64(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain)),
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain + domain_stride))
+        );
+        __m128i b = _mm_unpacklo_epi64(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rank)),
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(rank + rank_stride))
+        );
+        __m256i diff = _mm256_sub_epi16(_mm256_cvtepu8_epi16(a), _mm256_cvtepu8_epi16(b));
+        __m256i squares = _mm256_madd_epi16(diff, diff);
+        sum += hsum_epi32(_mm256_castsi256_si128(squares));
+        if (sum >= error) {
+            return kTerminated;
+        }
+        sum += hsum_epi32(_mm256_extracti128_si256(squares, 1));
+        if (sum >= error) {
+            return kTerminated;
         }
     }
     return sum;
-}
\ No newline at end of file
+}
+
+ME_TARGET_AVX2 int sad_16_avx2(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    if (block_size % 32 != 0) {
+        return sad_16_sse41(domain, domain_stride, rank, rank_stride, block_size, error);
+    }
+    int sum = 0;
+    for (int h = 0; h < block_size; h++, domain += domain_stride, rank += rank_stride) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int w = 0; w < block_size; w += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(domain + w));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rank + w));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a, b));
+        }
+        sum += hsum_sad(_mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+ME_TARGET_AVX512 inline int hsum_epi32_avx512(__m512i v) {
+    return hsum_epi32_avx2(_mm256_add_epi32(
+        _mm512_maskz_extracti64x4_epi64(0xFF, v, 0),
+        _mm512_maskz_extracti64x4_epi64(0xFF, v, 1)
+    ));
+}
+
+// Two 16 pixel rows per zmm register, reduced half by half.
+ME_TARGET_AVX512 int ssd_16_avx512(
+    const unsigned char* domain, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error
+) {
+    if (block_size != 16) {
+        return ssd_16_avx2(domain, domain_stride, rank, rank_stride, block_size, error);
+    }
+    int sum = 0;
+    for (int h = 0; h < block_size; h += 2, domain += 2 * domain_stride, rank += 2 * rank_stride) {
+        __m256i a = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(domain))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(domain + domain_stride)), 1
+        );
+        __m256i b = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rank))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + rank_stride)), 1
+        );
+        __m512i diff = _mm512_sub_epi16(_mm512_cvtepu8_epi16(a), _mm512_cvtepu8_epi16(b));
+        __m512i squares = _mm512_madd_epi16(diff, diff);
+        sum += hsum_epi32_avx2(_mm512_maskz_extracti64x4_epi64(0xFF, squares, 0));
+        if (sum >= error) {
+            return kTerminated;
+        }
+        sum += hsum_epi32_avx2(_mm512_maskz_extracti64x4_epi64(0xFF, squares, 1));
+        if (sum >= error) {
+            return kTerminated;
+        }
+    }
+    return sum;
+}
+
+// Batch kernels. The rank block is widened once up front; the termination
+// check runs every four rows, which does not change any result because the
+// partial sums only grow.
+constexpr int kBatchCheckRows = 4;
+
+ME_TARGET_SSE41 void ssd_batch_8_sse41(
+    const unsigned char* const* domains, int count, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error, int* costs
+) {
+    if (block_size != 8) {
+        ssd_batch_generic(domains, count, domain_stride, rank, rank_stride, block_size, error, costs);
+        return;
+    }
+    __m128i rank_rows[8];
+    for (int h = 0; h < 8; h++) {
+        rank_rows[h] = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rank + h * rank_stride)));
+    }
+    for (int i = 0; i < count; i++) {
+        const unsigned char* domain = domains[i];
+        __m128i acc = _mm_setzero_si128();
+        int sum = 0;
+        for (int h = 0; h < 8; h++, domain += domain_stride) {
+            __m128i row = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain)));
+            __m128i diff = _mm_sub_epi16(row, rank_rows[h]);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, diff));
+            if ((h + 1) % kBatchCheckRows == 0) {
+                sum = hsum_epi32(acc);
+                if (sum >= error) {
+                    break;
+                }
+            }
+        }
+        costs[i] = sum >= error ? kTerminated : sum;
+    }
+}
+
+ME_TARGET_SSE41 void ssd_batch_16_sse41(
+    const unsigned char* const* domains, int count, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error, int* costs
+) {
+    if (block_size != 16) {
+        ssd_batch_generic(domains, count, domain_stride, rank, rank_stride, block_size, error, costs);
+        return;
+    }
+    __m128i rank_rows[16];
+    for (int h = 0; h < 16; h++) {
+        rank_rows[h] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + h * rank_stride));
+    }
+    for (int i = 0; i < count; i++) {
+        const unsigned char* domain = domains[i];
+        __m128i acc = _mm_setzero_si128();
+        int sum = 0;
+        for (int h = 0; h < 16; h++, domain += domain_stride) {
+            __m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(domain));
+            acc = _mm_add_epi32(acc, ssd8_sse41(row, rank_rows[h]));
+            acc = _mm_add_epi32(acc, ssd8_sse41(_mm_srli_si128(row, 8), _mm_srli_si128(rank_rows[h], 8)));
+            if ((h + 1) % kBatchCheckRows == 0) {
+                sum = hsum_epi32(acc);
+                if (sum >= error) {
+                    break;
+                }
+            }
+        }
+        costs[i] = sum >= error ? kTerminated : sum;
+    }
+}
+
+ME_TARGET_AVX2 void ssd_batch_8_avx2(
+    const unsigned char* const* domains, int count, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error, int* costs
+) {
+    if (block_size != 8) {
+        ssd_batch_generic(domains, count, domain_stride, rank, rank_stride, block_size, error, costs);
+        return;
+    }
+    // Two rows per register
+    __m256i rank_rows[4];
+    for (int h = 0; h < 4; h++) {
+        const unsigned char* row = rank + 2 * h * rank_stride;
+        rank_rows[h] = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row)),
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row + rank_stride))
+        ));
+    }
+    for (int i = 0; i < count; i++) {
+        const unsigned char* domain = domains[i];
+        __m256i acc = _mm256_setzero_si256();
+        int sum = 0;
+        for (int h = 0; h < 4; h++, domain += 2 * domain_stride) {
+            __m256i rows = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain)),
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(domain + domain_stride))
+            ));
+            __m256i diff = _mm256_sub_epi16(rows, rank_rows[h]);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+            if ((2 * h + 2) % kBatchCheckRows == 0) {
+                sum = hsum_epi32_avx2(acc);
+                if (sum >= error) {
+                    break;
+                }
+            }
+        }
+        costs[i] = sum >= error ? kTerminated : sum;
+    }
+}
+
+ME_TARGET_AVX2 void ssd_batch_16_avx2(
+    const unsigned char* const* domains, int count, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error, int* costs
+) {
+    if (block_size != 16) {
+        ssd_batch_generic(domains, count, domain_stride, rank, rank_stride, block_size, error, costs);
+        return;
+    }
+    __m256i rank_rows[16];
+    for (int h = 0; h < 16; h++) {
+        rank_rows[h] = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rank + h * rank_stride)));
+    }
+    for (int i = 0; i < count; i++) {
+        const unsigned char* domain = domains[i];
+        __m256i acc = _mm256_setzero_si256();
+        int sum = 0;
+        for (int h = 0; h < 16; h++, domain += domain_stride) {
+            __m256i row = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(domain)));
+            __m256i diff = _mm256_sub_epi16(row, rank_rows[h]);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+            if ((h + 1) % kBatchCheckRows == 0) {
+                sum = hsum_epi32_avx2(acc);
+                if (sum >= error) {
+                    break;
+                }
+            }
+        }
+        costs[i] = sum >= error ? kTerminated : sum;
+    }
+}
+
+ME_TARGET_AVX512 void ssd_batch_16_avx512(
+    const unsigned char* const* domains, int count, int domain_stride,
+    const unsigned char* rank, int rank_stride,
+    int block_size, int error, int* costs
+) {
+    if (block_size != 16) {
+        ssd_batch_16_avx2(domains, count, domain_stride, rank, rank_stride, block_size, error, costs);
+        return;
+    }
+    // Two rows per register, the whole rank block takes 8 zmm registers
+    __m512i rank_rows[8];
+    for (int h = 0; h < 8; h++) {
+        const unsigned char* row = rank + 2 * h * rank_stride;
+        rank_rows[h] = _mm512_cvtepu8_epi16(_mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + rank_stride)), 1
+        ));
+    }
+    for (int i = 0; i < count; i++) {
+        const unsigned char* domain = domains[i];
+        __m512i acc = _mm512_setzero_si512();
+        int sum = 0;
+        for (int h = 0; h < 8; h++, domain += 2 * domain_stride) {
+            __m512i rows = _mm512_cvtepu8_epi16(_mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(domain))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(domain + domain_stride)), 1
+            ));
+            __m512i diff = _mm512_sub_epi16(rows, rank_rows[h]);
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff, diff));
+            if ((2 * h + 2) % kBatchCheckRows == 0) {
+                sum = hsum_epi32_avx512(acc);
+                if (sum >= error) {
+                    break;
+                }
+            }
+        }
+        costs[i] = sum >= error ? kTerminated : sum;
+    }
+}
+
+#endif // ME_X86_KERNELS
+
+DistortionKernels make_kernels(SimdLevel level) {
+    DistortionKernels kernels = {
+        {ssd_scalar, ssd_scalar, ssd_scalar, ssd_scalar},
+        {sad_scalar, sad_scalar, sad_scalar, sad_scalar},
+        {ssd_batch_generic, ssd_batch_generic, ssd_batch_generic, ssd_batch_generic},
+        SimdLevel::Scalar
+    };
+#ifdef ME_X86_KERNELS
+    if (level >= SimdLevel::SSE41) {
+        kernels.ssd[0] = ssd_4_sse41;
+        kernels.ssd[1] = ssd_8_sse41;
+        kernels.ssd[2] = ssd_16_sse41;
+        kernels.sad[0] = sad_4_sse41;
+        kernels.sad[1] = sad_8_sse41;
+        kernels.sad[2] = sad_16_sse41;
+        kernels.ssd_batch[1] = ssd_batch_8_sse41;
+        kernels.ssd_batch[2] = ssd_batch_16_sse41;
+        kernels.level = SimdLevel::SSE41;
+    }
+    // 4x4 rows are too narrow to gain anything from wider registers
+    if (level >= SimdLevel::AVX2) {
+        kernels.ssd[1] = ssd_8_avx2;
+        kernels.ssd[2] = ssd_16_avx2;
+        kernels.sad[2] = sad_16_avx2;
+        kernels.ssd_batch[1] = ssd_batch_8_avx2;
+        kernels.ssd_batch[2] = ssd_batch_16_avx2;
+        kernels.level = SimdLevel::AVX2;
+    }
+    if (level >= SimdLevel::AVX512) {
+        kernels.ssd[2] = ssd_16_avx512;
+        kernels.ssd_batch[2] = ssd_batch_16_avx512;
+        kernels.level = SimdLevel::AVX512;
+    }
+#endif
+    return kernels;
+}
+
+// One table per level, never written after static initialisation. Switching
+// levels only swaps the pointer, so searches running on other threads keep
+// reading a complete table, the old one or the new one.
+const DistortionKernels level_kernels[] = {
+    make_kernels(SimdLevel::Scalar),
+    make_kernels(SimdLevel::SSE41),
+    make_kernels(SimdLevel::AVX2),
+    make_kernels(SimdLevel::AVX512)
+};
+
+std::atomic<const DistortionKernels*> active_kernels(&level_kernels[int(detect_simd_level())]);
+
+} // namespace
+
+SimdLevel detect_simd_level() {
+#ifdef ME_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return SimdLevel::SSE41;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+SimdLevel select_distortion_kernels(SimdLevel level) {
+    SimdLevel supported = detect_simd_level();
+    if (level > supported) {
+        level = supported;
+    }
+    const DistortionKernels* kernels = &level_kernels[int(level)];
+    active_kernels.store(kernels, std::memory_order_release);
+    return kernels -> level;
+}
+
+const DistortionKernels& distortion_kernels() {
+    return *active_kernels.load(std::memory_order_acquire);
+}
+
+const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE41: return "sse4.1";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
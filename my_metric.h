@@ -15,3 +15,107 @@ int compute_abs_difference(
     int block_size = 16,
     int error = std::numeric_limits<int>::max()
 );
+
+// Instruction sets the distortion kernels are compiled for. The best one
+// supported by the running CPU is picked on first use.
+enum class SimdLevel {
+    Scalar = 0,
+    SSE41,
+    AVX2,
+    AVX512
+};
+
+// Every kernel compares two square blocks given by their top-left pixel and
+// row stride. Once the running sum reaches `error` (checked after every row)
+// std::numeric_limits<int>::max() is returned, exactly like the scalar loop.
+typedef int (*BlockDistortionKernel)(
+    const unsigned char* domain,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error
+);
+
+// Scores `count` domain blocks sharing one stride against the same rank
+// block, which is loaded once and kept in registers. Every cost is bounded by
+// the same `error`, so a caller that walks `costs` in order and keeps the
+// running minimum ends up with the same winner as sequential calls would.
+typedef void (*BatchDistortionKernel)(
+    const unsigned char* const* domains,
+    int count,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error,
+    int* costs
+);
+
+struct DistortionKernels {
+    // Indexed by KernelWidth(block_size)
+    BlockDistortionKernel ssd[4];
+    BlockDistortionKernel sad[4];
+    BatchDistortionKernel ssd_batch[4];
+    SimdLevel level;
+};
+
+// 0 - 4x4, 1 - 8x8, 2 - multiple of 16, 3 - anything else (scalar)
+inline int KernelWidth(int block_size) {
+    if (block_size == 4) return 0;
+    if (block_size == 8) return 1;
+    if (block_size % 16 == 0) return 2;
+    return 3;
+}
+
+SimdLevel detect_simd_level();
+// Switches the kernels used by block_ssd / block_sad, levels the CPU does not
+// support are clamped to the best supported one. Returns the level in use.
+// Safe while other threads search, they finish a call on the old kernels.
+SimdLevel select_distortion_kernels(SimdLevel level);
+const DistortionKernels& distortion_kernels();
+const char* simd_level_name(SimdLevel level);
+
+// Sum of squared differences
+inline int block_ssd(
+    const unsigned char* domain,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error = std::numeric_limits<int>::max()
+) {
+    return distortion_kernels().ssd[KernelWidth(block_size)](
+        domain, domain_stride, rank, rank_stride, block_size, error
+    );
+}
+
+// Sum of absolute differences
+inline int block_sad(
+    const unsigned char* domain,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int error = std::numeric_limits<int>::max()
+) {
+    return distortion_kernels().sad[KernelWidth(block_size)](
+        domain, domain_stride, rank, rank_stride, block_size, error
+    );
+}
+
+// Sum of squared differences for several candidates at once
+inline void block_ssd_batch(
+    const unsigned char* const* domains,
+    int count,
+    int domain_stride,
+    const unsigned char* rank,
+    int rank_stride,
+    int block_size,
+    int* costs,
+    int error = std::numeric_limits<int>::max()
+) {
+    distortion_kernels().ssd_batch[KernelWidth(block_size)](
+        domains, count, domain_stride, rank, rank_stride, block_size, error, costs
+    );
+}
@@ -1,6 +1,48 @@
 #include "my_motion_estimator.h"
 
-namespace py = pybind11;
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+
+namespace {
+
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool IsPowerOfTwo(int value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+// Returns block_size, checked before anything is sized by it
+int CheckBlockSizes(int block_size, int min_block_size) {
+    if (!IsPowerOfTwo(block_size) || block_size < 8 || block_size > 64 ||
+        !IsPowerOfTwo(min_block_size) || min_block_size < 4 || min_block_size > block_size)
+    {
+        throw std::invalid_argument("Block sizes have to be powers of two, 8 <= block_size <= 64 and 4 <= min_block_size <= block_size");
+    }
+    return block_size;
+}
+
+// Copies a chroma plane whose samples are `step` bytes apart into a
+// contiguous height x width plane
+void CopyChroma(const unsigned char* plane, ptrdiff_t stride, int step, int height, int width, std::vector<unsigned char>& copy) {
+    copy.resize(size_t(height) * width);
+    for (int h = 0; h < height; h++) {
+        const unsigned char* source = plane + h * stride;
+        unsigned char* destination = copy.data() + size_t(h) * width;
+        if (step == 1) {
+            std::memcpy(destination, source, width);
+        } else {
+            for (int w = 0; w < width; w++) {
+                destination[w] = source[w * step];
+            }
+        }
+    }
+}
+
+}
 
 template<typename T>
 std::pair<T, T> operator+(const std::pair<T, T>& a, const std::pair<T, T>& b) {
@@ -11,34 +53,57 @@ MotionEstimator::MotionEstimator(
     int width, 
     int height,
     int quality,
-    bool use_halfpixel
-) : _width(width),
+    bool use_halfpixel,
+    int block_size,
+    int min_block_size
+) : _elimination_level(0),
+    _width(width),
     _height(height),
     _quality(quality),
     _use_halfpixel(use_halfpixel),
+    _block_size(CheckBlockSizes(block_size, min_block_size)),
+    _min_block_size(min_block_size),
+    _split_share(35),
     SEARCH_MODE(MODE::DiamondSearch),
-    _3DRS_offset_index(0),
+    _static_threshold(450),
+    _stop_threshold(450),
+    candidate_threshold(450),
+    _blocks_per_row((width + _block_size - 1) / _block_size),
+    _blocks_per_column((height + _block_size - 1) / _block_size),
+    _references_filled(0),
+    _reference_threshold(40'000),
+    _future_filled(0),
+    _lazy_halfpel(false),
+    _visited_cache(true),
+    _extend_borders(false),
+    // A block fully outside of the picture plus the brute-force range
+    border_size(2 * _block_size),
+    new_width(2 * border_size + width),
+    new_height(2 * border_size + height),
+    is_first(true),
     _brute_force_stride(1),
-    _brute_force_width(16),
     _brute_force_height(16),
-    _cross_search_side(8),
+    _brute_force_width(16),
     _cross_search_error_threshold(100),
     _cross_search_split_threshold(1000),
-    _orthonormal_search_step_size(9), 
+    _cross_search_side(8),
+    _orthonormal_search_step_size(9),
     _three_step_search_side(8),
-    _static_threshold(450),
-    is_first(true),
-    border_size(16),
-    new_height(2 * border_size + height),
-    new_width(2 * border_size + width),
-    candidate_threshold(450),
-    _stop_threshold(450) {
-        if (_use_halfpixel) {
-            this -> previous_up = new unsigned char[_height * _width];
-            this -> previous_left = new unsigned char[_height * _width];
-            this -> previous_up_left = new unsigned char[_height * _width];
-        }
-        previous_extended = new unsigned char[new_height * new_width];
+    _pyramid_levels(1),
+    _seeded(false),
+    _thread_count(1),
+    _thread_pool(new ThreadPool(1)),
+    _contexts(1),
+    _effort_map(false),
+    _change_detection(false),
+    _row_progress(new std::atomic<int>[(height + _block_size - 1) / _block_size]) {
+        this -> previous_field.Resize(_blocks_per_column, _blocks_per_row, _block_size, _min_block_size);
+        this -> current_field.Resize(_blocks_per_column, _blocks_per_row, _block_size, _min_block_size);
+        this -> backward_field.Resize(_blocks_per_column, _blocks_per_row, _block_size, _min_block_size);
+        this -> previous_backward_field.Resize(_blocks_per_column, _blocks_per_row, _block_size, _min_block_size);
+        this -> _references.push_back(std::make_unique<ReferenceFrame>());
+        this -> _future_references.push_back(std::make_unique<ReferenceFrame>());
+        this -> _seeds.resize(size_t(_blocks_per_row) * _blocks_per_column);
         if (quality == 0) {
             _error_threshold = std::numeric_limits<int>::max();
         } else if (quality == 20) {
@@ -72,14 +137,50 @@ MotionEstimator::MotionEstimator(
                                            {0, -2}, {-2, 0}, {0, 2}, {-2, 0} }};
     }
 
-MotionEstimator::~MotionEstimator() {
-    delete[] previous_extended;
-    if (_use_halfpixel) {
-        delete[] previous_up;
-        delete[] previous_left;
-        delete[] previous_up_left;
+MotionEstimator::~MotionEstimator() = default;
+
+inline bool MotionEstimator::CanEliminate(
+    const Matrix& domain,
+    int domain_h,
+    int domain_w,
+    const Matrix& rank,
+    int rank_h,
+    int rank_w,
+    int block_size,
+    int error
+) const {
+    const IntegralImage& domain_sums = *domain.getSums();
+    const IntegralImage& rank_sums = *rank.getSums();
+    // Block sizes are powers of two, so the divisions below are shifts
+    int log_size = __builtin_ctz(block_size);
+    if (this -> _elimination_level == 1 || block_size < 4) {
+        // Cauchy-Schwarz: (sum a - sum b)^2 <= N * sum (a - b)^2
+        int64_t difference = domain_sums.Sum(domain_h, domain_w, block_size, block_size) -
+                             rank_sums.Sum(rank_h, rank_w, block_size, block_size);
+        return ((difference * difference) >> (2 * log_size)) >= error;
+    }
+    // The same bound holds for every quadrant and their sum is tighter. The
+    // whole-block bound is tried first because it is the cheapest.
+    int domain_quadrants[4], rank_quadrants[4];
+    domain_sums.QuadrantSums(domain_h, domain_w, block_size, domain_quadrants);
+    rank_sums.QuadrantSums(rank_h, rank_w, block_size, rank_quadrants);
+    int64_t difference = 0;
+    int64_t bound = 0;
+    for (int i = 0; i < 4; i++) {
+        int64_t quadrant_difference = domain_quadrants[i] - rank_quadrants[i];
+        difference += quadrant_difference;
+        bound += (quadrant_difference * quadrant_difference) >> (2 * log_size - 2);
     }
+    if (((difference * difference) >> (2 * log_size)) >= error || bound >= error) {
+        return true;
+    }
+    // Triangle inequality on the L2 norms: (|a| - |b|)^2 <= |a - b|^2,
+    // shrunk a little so that rounding can not make it exceed the truth.
+    double norm_difference = std::sqrt(double(domain_sums.SquareSum(domain_h, domain_w, block_size, block_size))) -
+                             std::sqrt(double(rank_sums.SquareSum(rank_h, rank_w, block_size, block_size)));
+    return norm_difference * norm_difference * (1.0 - 1e-9) >= error;
 }
+
 int MotionEstimator::ComputeAbsDifference(
     const Matrix& domain, 
     int domain_h,
@@ -91,36 +192,226 @@ int MotionEstimator::ComputeAbsDifference(
     int error
 )  {
     // Rank blocks are always under control, so just check if domain 
-    // block lays inside the picture.
-    if (domain_h < 0 || domain_h + block_size - 1 >= domain.getHeight() || 
-        domain_w < 0 || domain_w + block_size - 1 >= domain.getWidth()) 
-    {
+    // block lays inside the picture (or its border, if it is padded).
+    if (!domain.isInside(domain_h, domain_w, block_size)) {
            return std::numeric_limits<int>::max();
     }
-    // if (block_size == 16) {
-    //     int domain_abs_sum = this -> previous_frame_precomputed[(domain_h + domain_w) >> 8];
-    //     int rank_abs_sum = this -> current_frame_precomputed[(rank_w + rank_h) >> 8];
-        
-    //     if (std::abs(domain_abs_sum - rank_abs_sum) >= error) {
-    //         return std::numeric_limits<int>::max();
-    //     }
-    // }
+    if (domain.getTiles()) {
+        domain.getTiles() -> Ensure(domain_h, domain_w, block_size);
+    }
+    // Successive elimination, if even the lower bound reaches the error the
+    // full comparison would be terminated anyway.
+    if (error != std::numeric_limits<int>::max() && _elimination_level > 0 &&
+        domain.getSums() && rank.getSums() && rank.isInside(rank_h, rank_w, block_size) &&
+        CanEliminate(domain, domain_h, domain_w, rank, rank_h, rank_w, block_size, error))
+    {
+        return std::numeric_limits<int>::max();
+    }
 
-    int sum = 0;
-    for (int h = 0; h < block_size; h++) {
-        for (int w = 0; w < block_size; w++) {
-            int16_t value = domain.get(h + domain_h, w + domain_w) - rank.get(h + rank_h, w + rank_w);
-            sum += value * value;
-            // sum += std::abs(domain.get(h + domain_h, w + domain_w) - rank.get(h + rank_h, w + rank_w)); 
-            if (sum >= error) {
-                return std::numeric_limits<int>::max();
-            }
+    // Squared difference, the kernel is picked from the CPU features once
+    return block_ssd(
+        domain.ptr(domain_h, domain_w),
+        domain.getStride(),
+        rank.ptr(rank_h, rank_w),
+        rank.getStride(),
+        block_size,
+        error
+    );
+}
+
+void MotionEstimator::ComputeAbsDifferenceBatch(
+    const Matrix& domain,
+    int domain_h,
+    int domain_w,
+    const std::pair<int, int>* offsets,
+    int count,
+    const Matrix& rank,
+    int rank_h,
+    int rank_w,
+    int block_size,
+    int error,
+    int* costs
+) {
+    // Candidates outside of the picture are rejected here, the rest is
+    // scored by one kernel call that loads the rank block only once.
+    std::array<const unsigned char*, _max_batch_size> domains;
+    std::array<int, _max_batch_size> inside;
+    int inside_count = 0;
+    for (int i = 0; i < count; i++) {
+        int h = domain_h + offsets[i].first;
+        int w = domain_w + offsets[i].second;
+        costs[i] = std::numeric_limits<int>::max();
+        if (!domain.isInside(h, w, block_size)) {
+            continue;
+        }
+        if (error != std::numeric_limits<int>::max() && _elimination_level > 0 &&
+            domain.getSums() && rank.getSums() && rank.isInside(rank_h, rank_w, block_size) &&
+            CanEliminate(domain, h, w, rank, rank_h, rank_w, block_size, error))
+        {
+            continue;
         }
+        if (domain.getTiles()) {
+            domain.getTiles() -> Ensure(h, w, block_size);
+        }
+        domains[inside_count] = domain.ptr(h, w);
+        inside[inside_count++] = i;
+    }
+    std::array<int, _max_batch_size> inside_costs;
+    block_ssd_batch(
+        domains.data(),
+        inside_count,
+        domain.getStride(),
+        rank.ptr(rank_h, rank_w),
+        rank.getStride(),
+        block_size,
+        inside_costs.data(),
+        error
+    );
+    for (int i = 0; i < inside_count; i++) {
+        costs[inside[i]] = inside_costs[i];
+    }
+}
+
+int MotionEstimator::ScoreCandidate(
+    SearchContext& context,
+    const Matrix& domain,
+    int domain_h,
+    int domain_w,
+    const Matrix& rank,
+    int rank_h,
+    int rank_w,
+    int block_size,
+    int error
+) {
+    int cost = ComputeAbsDifference(domain, domain_h, domain_w, rank, rank_h, rank_w, block_size, error);
+    context.Count(&SearchStats::evaluations);
+    if (cost == std::numeric_limits<int>::max()) {
+        context.Count(&SearchStats::terminated);
+    }
+    return cost;
+}
+
+void MotionEstimator::ScoreCandidates(
+    SearchContext& context,
+    const Matrix& domain,
+    int domain_h,
+    int domain_w,
+    const std::pair<int, int>* offsets,
+    int count,
+    const Matrix& rank,
+    int rank_h,
+    int rank_w,
+    int block_size,
+    int error,
+    int* costs
+) {
+    // A cached cost was bounded by an error at least as large as the current
+    // one, the searches only lower it. So a cached max() still means
+    // "not better" and every other cached cost is exact.
+    std::array<std::pair<int, int>, _max_batch_size> missing;
+    std::array<int, _max_batch_size> missing_index;
+    int missing_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (!this -> _visited_cache || !context._visited.Find(domain_h + offsets[i].first, domain_w + offsets[i].second, costs[i])) {
+            missing[missing_count] = offsets[i];
+            missing_index[missing_count++] = i;
+        }
+    }
+    context.Count(&SearchStats::evaluations, missing_count);
+    context.Count(&SearchStats::reused, count - missing_count);
+    if (missing_count == 0) {
+        return;
+    }
+    std::array<int, _max_batch_size> missing_costs;
+    ComputeAbsDifferenceBatch(domain, domain_h, domain_w, missing.data(), missing_count, rank, rank_h, rank_w, block_size, error, missing_costs.data());
+    for (int i = 0; i < missing_count; i++) {
+        if (missing_costs[i] == std::numeric_limits<int>::max()) {
+            context.Count(&SearchStats::terminated);
+        }
+        costs[missing_index[i]] = missing_costs[i];
+        if (this -> _visited_cache) {
+            context._visited.Store(domain_h + missing[i].first, domain_w + missing[i].second, missing_costs[i]);
+        }
+    }
+}
+
+template<int block_size, typename QuarterSearch>
+inline MotionVector MotionEstimator::TrySplit(
+    SearchContext& context,
+    const Matrix& previous_frame,
+    const Matrix& current_frame,
+    int dh,
+    int dw,
+    const MotionVector& whole,
+    int threshold,
+    QuarterSearch&& search_quarter
+) {
+    constexpr int half = block_size >> 1;
+    if (block_size <= context._smallest_block || whole._error < SplitThreshold(threshold, block_size)) {
+        return whole;
+    }
+    // Quarters in the order top-left, top-right, bottom-right, bottom-left
+    static constexpr std::array<std::pair<int, int>, 4> shifts = {
+        {{0, 0},         {0, half},
+         {half, half},{half, 0}}
+    };
+    // Residual of the whole block per quarter, one evaluation of the block
+    // in total. A vector outside of the picture leaves nothing to compare.
+    if (this -> _split_share > 0 && whole._error != std::numeric_limits<int>::max()) {
+        int64_t residual = 0, worst = 0;
+        for (const auto&[shift_h, shift_w] : shifts) {
+            int quarter = ScoreCandidate(context, previous_frame, whole._h + shift_h, whole._w + shift_w, current_frame, dh + shift_h, dw + shift_w, half);
+            residual += quarter;
+            worst = std::max<int64_t>(worst, quarter);
+        }
+        if (100 * worst < this -> _split_share * residual) {
+            return whole;
+        }
+    }
+    // Sub-blocks outside of the picture cost max(), the sum may exceed int
+    std::array<MotionVector, 4> quarters;
+    int64_t split_error = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = dh + shifts[i].first, w = dw + shifts[i].second;
+        // Blocks on the frame border split until they fit, quarters below
+        // or right of the picture are never shown
+        if (h >= current_frame.getHeight() || w >= current_frame.getWidth()) {
+            quarters[i] = MotionVector(h, w, 0);
+            continue;
+        }
+        context.BeginSearch(h, w);
+        quarters[i] = search_quarter(h, w, whole._h + shifts[i].first, whole._w + shifts[i].second);
+        split_error += quarters[i]._error;
+        // Whatever the remaining quarters cost, the split already lost
+        if (split_error >= whole._error) {
+            return whole;
+        }
+    }
+    // Quarters that split themselves have written their leaves already
+    for (int i = 0; i < 4; i++) {
+        if (!quarters[i]._splitted) {
+            context._partition.Store(dh + shifts[i].first, dw + shifts[i].second, half, quarters[i]);
+        }
+    }
+    context.Count(&SearchStats::splits);
+    MotionVector split(whole._h, whole._w, int(split_error), whole.shift_dir);
+    split._splitted = true;
+    return split;
+}
+
+template<typename Search>
+inline MotionVector MotionEstimator::WithBlockSize(int block_size, Search&& search) {
+    switch (block_size) {
+        case 4: return search.template operator()<4>();
+        case 8: return search.template operator()<8>();
+        case 16: return search.template operator()<16>();
+        case 32: return search.template operator()<32>();
+        default: return search.template operator()<64>();
     }
-    return sum;
 }
 
 inline MotionVector MotionEstimator::FindBlock_BruteForce(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int h,
@@ -128,11 +419,11 @@ inline MotionVector MotionEstimator::FindBlock_BruteForce(
     int shifted_h,
     int shifted_w
 ) {
-    int error = ComputeAbsDifference(previous_frame, h, w, current_frame, h, w);
+    int error = ScoreCandidate(context, previous_frame, shifted_h, shifted_w, current_frame, h, w, this -> _block_size);
     int found_h = 0, found_w = 0;
     for (int dh = -_brute_force_height; dh <= _brute_force_height; dh += this -> _brute_force_stride) {
         for (int dw = -_brute_force_width; dw <= _brute_force_width; dw += this -> _brute_force_stride) {
-            int current_error = ComputeAbsDifference(previous_frame, dh + shifted_h, dw + shifted_w, current_frame, h, w, 16, error);
+            int current_error = ScoreCandidate(context, previous_frame, dh + shifted_h, dw + shifted_w, current_frame, h, w, this -> _block_size, error);
             if (current_error < error) {
                 error = current_error;
                 found_h = dh;
@@ -140,10 +431,12 @@ inline MotionVector MotionEstimator::FindBlock_BruteForce(
             }
         }
     }
-    return MotionVector(h + found_h, w + found_w, error);
+    return MotionVector(shifted_h + found_h, shifted_w + found_w, error);
 }
 
+template<int block_size>
 inline MotionVector MotionEstimator::FindBlock_CrossSearch(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -151,34 +444,20 @@ inline MotionVector MotionEstimator::FindBlock_CrossSearch(
     size_t side,
     int shifted_h,
     int shifted_w,
-    int error,
-    int block_size
+    int error
 ) {
     if (side <= 1) {
-        if (error >= this -> _cross_search_split_threshold && block_size == 16) {
-            block_size >>= 1;
-            std::vector<MotionVector> subvectors;
-            std::array<std::pair<int, int>, 4> shifts = {
-                {{0, 0},         {0, block_size},
-                 {block_size, block_size},{block_size, 0}}
-            };
-            for (size_t i = 0; i < 4; i++) {
-                subvectors.push_back(FindBlock_CrossSearch(
-                    previous_frame, 
-                    current_frame,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    this -> _cross_search_side,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    std::numeric_limits<int>::max(),
-                    block_size
-                ));
-            }
-            return MotionVector(subvectors);
-        } else { 
-            return MotionVector(shifted_h, shifted_w, error);
+        MotionVector whole(shifted_h, shifted_w, error);
+        if constexpr (block_size > 4) {
+            return TrySplit<block_size>(context, previous_frame, current_frame, dh, dw, whole, this -> _cross_search_split_threshold,
+                [&](int h, int w, int start_h, int start_w) {
+                    return FindBlock_CrossSearch<(block_size >> 1)>(
+                        context, previous_frame, current_frame, h, w, this -> _cross_search_side,
+                        start_h, start_w, std::numeric_limits<int>::max()
+                    );
+                });
         }
+        return whole;
     }
     size_t found_h = 0, found_w = 0;
     size_t halfside = side >> 1;
@@ -188,20 +467,21 @@ inline MotionVector MotionEstimator::FindBlock_CrossSearch(
         {-halfside, -halfside}, {halfside, -halfside}}
     };
     for (const auto&[offset_h, offset_w] : candidates) {
-        int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
+        int current_error = ScoreCandidate(context, previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
         if (current_error < error) {
             error = current_error;
             found_h = offset_h;
             found_w = offset_w;
         }
-        if (error < this -> _cross_search_error_threshold) {
+        if (error < ExitThreshold(this -> _cross_search_error_threshold, block_size)) {
             return MotionVector(shifted_h + found_h, shifted_w + found_w, error);
         }
     } 
     // Reference point stays the same, but offset updates and side halfs every iteration.
-    return FindBlock_CrossSearch(previous_frame, current_frame, dh, dw, halfside, shifted_h + found_h, shifted_w + found_w, error, block_size);
+    return FindBlock_CrossSearch<block_size>(context, previous_frame, current_frame, dh, dw, halfside, shifted_h + found_h, shifted_w + found_w, error);
 }
 inline MotionVector MotionEstimator::FindBlock_OrthonormalSearch(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -225,17 +505,18 @@ inline MotionVector MotionEstimator::FindBlock_OrthonormalSearch(
         candidates.push_back({step_size, 0});
     }
     for (const auto&[offset_h, offset_w] : candidates) {
-        int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, 16, error);
+        int current_error = ScoreCandidate(context, previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, this -> _block_size, error);
         if (current_error < error) {
             error = current_error;
             found_h = offset_h;
             found_w = offset_w;
         }
     }
-    return FindBlock_OrthonormalSearch(previous_frame, current_frame, dh, dw, step_size >> 1, shifted_h + found_h, shifted_w + found_w, error, is_horizontal ^ true); 
+    return FindBlock_OrthonormalSearch(context, previous_frame, current_frame, dh, dw, step_size >> 1, shifted_h + found_h, shifted_w + found_w, error, is_horizontal ^ true); 
 }
 
 inline MotionVector MotionEstimator::FindBlock_ThreeStepSearch(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -255,23 +536,26 @@ inline MotionVector MotionEstimator::FindBlock_ThreeStepSearch(
                  {0, -halfside}                        , {0, halfside},
                  {halfside, -halfside},  {halfside, 0} , {halfside, halfside}}
     };
-    for (const auto&[offset_h, offset_w] : candidates) {
-        int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, 16, error);
-        if (current_error < error) {
-            error = current_error;
+    std::array<int, candidates.size()> costs;
+    ScoreCandidates(context, previous_frame, shifted_h, shifted_w, candidates.data(), candidates.size(), current_frame, dh, dw, this -> _block_size, error, costs.data());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        const auto&[offset_h, offset_w] = candidates[i];
+        if (costs[i] < error) {
+            error = costs[i];
             found_h = offset_h;
             found_w = offset_w;
         }
         // Static background
-        if (error < this -> _cross_search_error_threshold) {
+        if (error < ExitThreshold(this -> _cross_search_error_threshold, this -> _block_size)) {
             return MotionVector(shifted_h + found_h, shifted_w + found_w, error);
         }
     } 
     // Reference point stays the same, but offset updates and side halfs every iteration.
-    return FindBlock_ThreeStepSearch(previous_frame, current_frame, dh, dw, halfside, shifted_h + found_h, shifted_w + found_w, error);
+    return FindBlock_ThreeStepSearch(context, previous_frame, current_frame, dh, dw, halfside, shifted_h + found_h, shifted_w + found_w, error);
 }
 
 inline MotionVector MotionEstimator::FindBlock_3DRS(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -280,21 +564,54 @@ inline MotionVector MotionEstimator::FindBlock_3DRS(
     int shifted_w,
     int error
 ) {
-    int found_h = 0, found_w = 0;
-    for (const auto& const_candidate : _3DRS_current_frame_offset) {
-        auto candidate = const_candidate + _3DRS_random_fluctuations[_3DRS_offset_index++];
-        _3DRS_offset_index %= _3DRS_random_fluct_size;
-        int current_error = compute_abs_difference(previous_frame, candidate.first, candidate.second, current_frame, dh, dw);
-        if (current_error < error) {
-            error = current_error;
-            found_h = candidate.first;
-            found_w = candidate.second;
+    // Displacement of the cell of a neighbouring block that touches this
+    // block, the zero vector outside of the picture
+    auto neighbour = [&](const MotionField& field, const std::pair<int, int>& blocks) {
+        int cell_size = field.getCellSize();
+        int h = dh + blocks.first * this -> _block_size + (blocks.first < 0 ? this -> _block_size - 1 : 0);
+        int w = dw + blocks.second * this -> _block_size + (blocks.second < 0 ? this -> _block_size - 1 : 0);
+        if (h < 0 || h >= field.getRows() * cell_size || w < 0 || w >= field.getColumns() * cell_size) {
+            return std::pair<int, int>(0, 0);
+        }
+        int cell = (h / cell_size) * field.getColumns() + w / cell_size;
+        return std::pair<int, int>(field._dy[cell], field._dx[cell]);
+    };
+    // Candidates relative to the block: the zero vector, the start, the
+    // spatial neighbours estimated before this block with and without an
+    // update, and the temporal neighbours from the previous field
+    std::array<std::pair<int, int>, _3DRS_candidate_count> candidates;
+    int count = 0;
+    auto add = [&](const std::pair<int, int>& candidate) {
+        // The same vector is often predicted twice, a batch would score it twice
+        if (std::find(candidates.begin(), candidates.begin() + count, candidate) == candidates.begin() + count) {
+            candidates[count++] = candidate;
+        }
+    };
+    add({0, 0});
+    add({shifted_h - dh, shifted_w - dw});
+    for (const auto& offset : _3DRS_current_frame_offset) {
+        auto spatial = neighbour(this -> current_field, offset);
+        add(spatial);
+        add(spatial + _3DRS_random_fluctuations[context._3DRS_offset_index++]);
+        context._3DRS_offset_index %= _3DRS_random_fluctuations.size();
+    }
+    for (const auto& offset : _3DRS_previous_frame_offset) {
+        add(neighbour(this -> previous_field, offset));
+    }
+
+    std::array<int, _3DRS_candidate_count> costs;
+    ScoreCandidates(context, previous_frame, dh, dw, candidates.data(), count, current_frame, dh, dw, this -> _block_size, error, costs.data());
+    int found = 0;
+    for (int i = 1; i < count; i++) {
+        if (costs[i] < costs[found]) {
+            found = i;
         }
     }
-    return MotionVector(0, 0, error);
+    return MotionVector(dh + candidates[found].first, dw + candidates[found].second, costs[found]);
 }
 
 inline MotionVector MotionEstimator::CheckIfStatic(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -303,22 +620,31 @@ inline MotionVector MotionEstimator::CheckIfStatic(
     int shifted_w,
     int block_size
 ) {
-    int error = this -> ComputeAbsDifference(
+    // The centre is scored again by the large pattern, so it goes through the cache
+    static constexpr std::pair<int, int> centre{0, 0};
+    int error;
+    ScoreCandidates(
+        context,
         previous_frame,
         shifted_h,
         shifted_w,
+        &centre,
+        1,
         current_frame,
         dh,
         dw,
-        block_size
+        block_size,
+        std::numeric_limits<int>::max(),
+        &error
     );
-    if (error < this -> _static_threshold) {
+    if (error < ExitThreshold(this -> _static_threshold, block_size)) {
         return MotionVector(shifted_h, shifted_w, error);
     }
     return MotionVector(-1, -1, error);
 }
 
 inline MotionVector MotionEstimator::GetCandidates(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -327,13 +653,11 @@ inline MotionVector MotionEstimator::GetCandidates(
     if (is_first) {
         return MotionVector(0, 0, std::numeric_limits<int>::max());
     }
-    // Block size shift
-    // ~ value /= 16;
     int error = std::numeric_limits<int>::max();
     int found_h = dh, found_w = dw;
     
-    dh >>= 4;
-    dw >>= 4;
+    dh /= this -> _block_size;
+    dw /= this -> _block_size;
     // Position of blocks, where candidates are located
     std::array<std::pair<int, int>, 4> previous_frame_c = {{
         {dh + 1, dw - 1}, {dh + 1, dw + 1}, {dh + 2, dw - 2}, {dh + 2, dw + 2}
@@ -341,55 +665,52 @@ inline MotionVector MotionEstimator::GetCandidates(
     std::array<std::pair<int, int>, 2> current_frame_c = {{
         {dh - 1, dw - 1}, {dh - 1, dw + 1}
     }};
-    dh <<= 4;
-    dw <<= 4;
+    dh *= this -> _block_size;
+    dw *= this -> _block_size;
 
     // Previous frame candidates
-    // For now implementation has only block-16 size (should I fix this now?)
     for (const auto&[candidate_h, candidate_w] : previous_frame_c) {
-        if (candidate_h < 0 || candidate_h >= ((this -> _height) >> 4) ||
-            candidate_w < 0 || candidate_w >= ((this -> _width) >> 4)) {
+        if (candidate_h < 0 || candidate_h >= _blocks_per_column ||
+            candidate_w < 0 || candidate_w >= _blocks_per_row) {
                 continue;
         }
-        MotionVector candidate = this -> previous_storage.at(candidate_h * (this -> _width / this -> _block_size) + candidate_w);
-        
         // Doesn't support splitted version for now
-        if (candidate._splitted) continue;
+        if (previous_field._split[candidate_h * _blocks_per_row + candidate_w]) continue;
 
-        // Subtract reference point
-        candidate._h -= candidate_h * this -> _block_size;
-        candidate._w -= candidate_w * this -> _block_size;
-        int current_error = ComputeAbsDifference(previous_frame, dh + candidate._h, dw + candidate._w, current_frame, dh, dw, this -> _block_size, error);
+        // Displacement, the reference point is already subtracted
+        int cell = previous_field.Cell(candidate_h, candidate_w);
+        int candidate_dh = previous_field._dy[cell], candidate_dw = previous_field._dx[cell];
+        int current_error = ScoreCandidate(context, previous_frame, dh + candidate_dh, dw + candidate_dw, current_frame, dh, dw, this -> _block_size, error);
         if (current_error < error) {
             error = current_error;
-            found_h = candidate._h;
-            found_w = candidate._w;
+            found_h = candidate_dh;
+            found_w = candidate_dw;
         }
     }
     // Current frame candidates
     for (const auto&[candidate_h, candidate_w] : current_frame_c) {
-        if (candidate_h < 0 || candidate_h >= ((this -> _height) >> 4) ||
-            candidate_w < 0 || candidate_w >= ((this -> _width) >> 4)) {
+        if (candidate_h < 0 || candidate_h >= _blocks_per_column ||
+            candidate_w < 0 || candidate_w >= _blocks_per_row) {
                 continue;
         }
         
-        MotionVector candidate = this -> current_storage.at(candidate_h * (this -> _width >> 4) + candidate_w);
-        if (candidate._splitted) continue;
-        // Subtract reference point
-        candidate._h -= candidate_h * this -> _block_size;
-        candidate._w -= candidate_w * this -> _block_size;
+        if (current_field._split[candidate_h * _blocks_per_row + candidate_w]) continue;
+        int cell = current_field.Cell(candidate_h, candidate_w);
+        int candidate_dh = current_field._dy[cell], candidate_dw = current_field._dx[cell];
 
-        int current_error = ComputeAbsDifference(previous_frame, dh + candidate._h, dw + candidate._w, current_frame, dh, dw, this -> _block_size, error);
+        int current_error = ScoreCandidate(context, previous_frame, dh + candidate_dh, dw + candidate_dw, current_frame, dh, dw, this -> _block_size, error);
         if (current_error < error) {
             error = current_error;
-            found_h = candidate._h;
-            found_w = candidate._w;
+            found_h = candidate_dh;
+            found_w = candidate_dw;
         }
     }
     return MotionVector(dh + found_h, dw + found_w, error);
 }
 
+template<int block_size>
 inline MotionVector MotionEstimator::FindBlock_DiamondSearch(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
@@ -397,82 +718,71 @@ inline MotionVector MotionEstimator::FindBlock_DiamondSearch(
     int shifted_h,
     int shifted_w,
     int error, 
-    int block_size,
     int shift_dir
 ) { 
-    MotionVector not_moving = CheckIfStatic(previous_frame, current_frame, dh, dw, shifted_h, shifted_w, block_size);
+    MotionVector not_moving = CheckIfStatic(context, previous_frame, current_frame, dh, dw, shifted_h, shifted_w, block_size);
     not_moving.shift_dir = shift_dir;
-    if (not_moving._error < this -> _static_threshold) {
+    if (not_moving._error < ExitThreshold(this -> _static_threshold, block_size)) {
+        context.Count(&SearchStats::static_hits);
         return not_moving;
     }
 
     int found_h = 0, found_w = 0;
-    for (const auto&[offset_h, offset_w] : this -> large_diamond) {
-        // if (_iteration_count >= 35) {
+    std::array<int, std::tuple_size<decltype(large_diamond)>::value> costs;
+    ScoreCandidates(context, previous_frame, shifted_h, shifted_w, large_diamond.data(), large_diamond.size(), current_frame, dh, dw, block_size, error, costs.data());
+    for (size_t i = 0; i < large_diamond.size(); i++) {
+        // if (context._iteration_count >= 35) {
         //     return MotionVector(shifted_h + found_h, shifted_w + found_w, error, shift_dir);
         // }
-        int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
-        if (current_error < error) {
-            error = current_error;
+        const auto&[offset_h, offset_w] = large_diamond[i];
+        if (costs[i] < error) {
+            error = costs[i];
             found_h = offset_h;
             found_w = offset_w;
         }
-        if (error <= this -> _stop_threshold) {
+        if (error <= ExitThreshold(this -> _stop_threshold, block_size)) {
             return MotionVector(shifted_h + found_h, shifted_w + found_w, error, shift_dir);
         }
-        // _diamond_search_error_map[key] = current_error;
     }
     if (found_h == 0 && found_w == 0) {
-        for (const auto&[offset_h, offset_w] : this -> small_diamond) {
-            int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
-            if (current_error < error) {
-                error = current_error;
-                found_h = offset_h;
-                found_w = offset_w;
+        std::array<int, std::tuple_size<decltype(small_diamond)>::value> small_costs;
+        ScoreCandidates(context, previous_frame, shifted_h, shifted_w, small_diamond.data(), small_diamond.size(), current_frame, dh, dw, block_size, error, small_costs.data());
+        for (size_t i = 0; i < small_diamond.size(); i++) {
+            if (small_costs[i] < error) {
+                error = small_costs[i];
+                found_h = small_diamond[i].first;
+                found_w = small_diamond[i].second;
             }
         }
-        if (error >= _error_threshold && block_size >= 16) {
-            std::vector<MotionVector> subvectors;
-            std::array<std::pair<int, int>, 4> shifts = {
-                {{0, 0},         {0, block_size >> 1},
-                 {block_size >> 1, block_size >> 1},{block_size >> 1, 0}}
-            };
-
-            int new_error = 0;
-            for (int i = 0; i < 4; i++) {
-                subvectors.push_back(FindBlock_DiamondSearch(
-                    previous_frame, 
-                    current_frame,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    std::numeric_limits<int>::max(),
-                    block_size >> 1,
-                    shift_dir
-                ));
-                new_error += subvectors[i]._error;
-            }
-            if (new_error < error) {
-                return MotionVector(subvectors, new_error);
-            } 
+        MotionVector whole(found_h + shifted_h, found_w + shifted_w, error, shift_dir);
+        if constexpr (block_size > 4) {
+            return TrySplit<block_size>(context, previous_frame, current_frame, dh, dw, whole, this -> _error_threshold,
+                [&](int h, int w, int start_h, int start_w) {
+                    return FindBlock_DiamondSearch<(block_size >> 1)>(
+                        context, previous_frame, current_frame, h, w, start_h, start_w,
+                        std::numeric_limits<int>::max(), shift_dir
+                    );
+                });
         }
-        return MotionVector(found_h + shifted_h, found_w + shifted_w, error, shift_dir);   
+        return whole;
     }
-    return FindBlock_DiamondSearch(previous_frame, current_frame, dh, dw, found_h + shifted_h, found_w + shifted_w, error, block_size, shift_dir);
+    context._iteration_count++;
+    context.ReachDepth(context._iteration_count);
+    return FindBlock_DiamondSearch<block_size>(context, previous_frame, current_frame, dh, dw, found_h + shifted_h, found_w + shifted_w, error, shift_dir);
 }
 
+template<int block_size>
 inline MotionVector MotionEstimator::FindBlock_HexagonSearch(
+    SearchContext& context,
     const Matrix& previous_frame,
     const Matrix& current_frame,
     int dh,
     int dw,
     int shifted_h,
     int shifted_w,
-    int error, 
-    int block_size
+    int error
 ) {
-    std::array<std::pair<int, int>, 9> large_hexagon = {{
+    static constexpr std::array<std::pair<int, int>, 7> large_hexagon = {{
                 {-2, -1},       {-2, 1},
         
         {0, -2},         {0,  0},       {0, 2},
@@ -480,59 +790,52 @@ inline MotionVector MotionEstimator::FindBlock_HexagonSearch(
                 {2,  -1},       {2, 1}
     }};
     int found_h = 0, found_w = 0;
-    for (const auto&[offset_h, offset_w] : large_hexagon) {
-        if (_iteration_count >= 50) {
+    std::array<int, large_hexagon.size()> costs;
+    ScoreCandidates(context, previous_frame, shifted_h, shifted_w, large_hexagon.data(), large_hexagon.size(), current_frame, dh, dw, block_size, error, costs.data());
+    for (size_t i = 0; i < large_hexagon.size(); i++) {
+        if (context._iteration_count >= 50) {
             return MotionVector(shifted_h + found_h, shifted_w + found_w, error);
         }
 
-        int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
-        if (current_error < error) {
-            error = current_error;
+        const auto&[offset_h, offset_w] = large_hexagon[i];
+        if (costs[i] < error) {
+            error = costs[i];
             found_h = offset_h;
             found_w = offset_w;
         }
-        if (error <= this -> _static_threshold) {
+        if (error <= ExitThreshold(this -> _static_threshold, block_size)) {
             return MotionVector(shifted_h + found_h, shifted_w + found_w, error);
         }
-        // _diamond_search_error_map[key] = current_error;
     }
     if (found_h == 0 && found_w == 0) {
-        std::array<std::pair<int, int>, 4> small_hexagon = {{
+        static constexpr std::array<std::pair<int, int>, 4> small_hexagon = {{
             {0, -1}, {-1, 0}, {0, 1}, {-1, 0}
         }};
-        for (const auto&[offset_h, offset_w] : small_hexagon) {
-            // Make use of previously computed stuff
-            int current_error = ComputeAbsDifference(previous_frame, offset_h + shifted_h, offset_w  + shifted_w, current_frame, dh, dw, block_size, error);
-            if (current_error < error) {
-                error = current_error;
-                found_h = offset_h;
-                found_w = offset_w;
+        std::array<int, small_hexagon.size()> small_costs;
+        // Make use of previously computed stuff
+        ScoreCandidates(context, previous_frame, shifted_h, shifted_w, small_hexagon.data(), small_hexagon.size(), current_frame, dh, dw, block_size, error, small_costs.data());
+        for (size_t i = 0; i < small_hexagon.size(); i++) {
+            if (small_costs[i] < error) {
+                error = small_costs[i];
+                found_h = small_hexagon[i].first;
+                found_w = small_hexagon[i].second;
             }
         }
-        if (error >= _error_threshold && block_size == 16) {
-            block_size >>= 1;
-            std::vector<MotionVector> subvectors;
-            std::array<std::pair<int, int>, 4> shifts = {
-                {{0, 0},         {0, block_size},
-                 {block_size, block_size},{block_size, 0}}
-            };
-            for (size_t i = 0; i < 4; i++) {
-                subvectors.push_back(FindBlock_HexagonSearch(
-                    previous_frame, 
-                    current_frame,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    dh + shifts[i].first,
-                    dw + shifts[i].second,
-                    std::numeric_limits<int>::max(),
-                    block_size
-                ));
-            }
-            return MotionVector(subvectors);
+        MotionVector whole(found_h + shifted_h, found_w + shifted_w, error);
+        if constexpr (block_size > 4) {
+            return TrySplit<block_size>(context, previous_frame, current_frame, dh, dw, whole, this -> _error_threshold,
+                [&](int h, int w, int start_h, int start_w) {
+                    return FindBlock_HexagonSearch<(block_size >> 1)>(
+                        context, previous_frame, current_frame, h, w, start_h, start_w,
+                        std::numeric_limits<int>::max()
+                    );
+                });
         }
-        return MotionVector(found_h + shifted_h, found_w + shifted_w, error);   
+        return whole;
     }
-    return FindBlock_HexagonSearch(previous_frame, current_frame, dh, dw, found_h + shifted_h, found_w + shifted_w, error, block_size);
+    context._iteration_count++;
+    context.ReachDepth(context._iteration_count);
+    return FindBlock_HexagonSearch<block_size>(context, previous_frame, current_frame, dh, dw, found_h + shifted_h, found_w + shifted_w, error);
 }
 
 int MotionEstimator::ComputeSum(
@@ -540,6 +843,9 @@ int MotionEstimator::ComputeSum(
     int h, 
     int w
 ) {
+    if (frame.getSums()) {
+        return frame.getSums() -> Sum(h, w, this -> _block_size, this -> _block_size);
+    }
     int sum = 0;
     for (int dh = 0; dh < this -> _block_size; dh++) {
         for (int dw = 0; dw < this -> _block_size; dw++) {
@@ -557,38 +863,7 @@ void MotionEstimator::GenerateSubpixelArrays(
     int height,
     int width
 ) {
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int cur_pixel_pos = y * width + x;
-            int left_pixel_pos = y * width + x - 1;
-            int left_up_pixel_pos = (y - 1) * width + x - 1;
-            int up_pixel_pos = (y - 1) * width + x;
-            
-            if (y > 0) {
-                output_up[cur_pixel_pos] = (int(input[cur_pixel_pos]) + input[up_pixel_pos]) / 2;
-            } else {
-                output_up[cur_pixel_pos] = input[cur_pixel_pos];
-            }
-            if (x > 0) {
-                output_left[cur_pixel_pos] = (int(input[cur_pixel_pos]) + input[left_pixel_pos]) / 2;
-            } else {
-                output_left[cur_pixel_pos] = input[cur_pixel_pos];
-            }
-
-            if (x > 0 && y > 0) {   
-                output_up_left[cur_pixel_pos] = (
-                        int(input[cur_pixel_pos]) + 
-                        input[left_pixel_pos] + 
-                        input[left_up_pixel_pos] + 
-                        input[up_pixel_pos]
-                ) / 4;
-            } else if (y == 0) {
-                output_up_left[cur_pixel_pos] = output_left[cur_pixel_pos];
-            } else {
-                output_up_left[cur_pixel_pos] = output_up[cur_pixel_pos];
-            }
-        }
-    }
+    interpolate_halfpel(input, output_up, output_left, output_up_left, width, 0, height, 0, width);
 }
 
 void MotionEstimator::ExtendBorders(
@@ -598,10 +873,8 @@ void MotionEstimator::ExtendBorders(
     // Copy frame to center of new
     auto p_output = output + new_width * border_size + border_size;
     auto p_input = input;
-    for (size_t y = 0; y < _height; ++y, p_output += 2 * border_size) {
-        for (size_t x = 0; x < _width; ++x, ++p_output, ++p_input) {
-            *p_output = *p_input;
-        }
+    for (size_t y = 0; y < _height; ++y, p_output += new_width, p_input += _width) {
+        memcpy(p_output, p_input, _width);
     }
 
     // Left and right borders.
@@ -622,7 +895,7 @@ void MotionEstimator::ExtendBorders(
         p_output += new_width;
     }
     p_output = output + new_width * (_height + border_size);
-    p_output_reference_row = p_output_reference_row - new_width;
+    p_output_reference_row = p_output - new_width;
 
     for (size_t y = 0; y < border_size; ++y) {
         memcpy(p_output, p_output_reference_row, new_width);
@@ -630,129 +903,1011 @@ void MotionEstimator::ExtendBorders(
     }
 }
 
-void MotionEstimator::Estimate(
-    py::array_t<unsigned char> _previous_frame,
-    py::array_t<unsigned char> _current_frame
-) {   
-    previous_storage = std::move(current_storage);
-    this -> current_storage.clear();
+void MotionEstimator::CheckFrame(FrameView frame) const {
+    if (frame.height != this -> _height || frame.width != this -> _width || frame.stride < frame.width) {
+        throw std::invalid_argument("Frames have to be " + std::to_string(_height) + "x" + std::to_string(_width));
+    }
+}
+
+const MotionField& MotionEstimator::Estimate(
+    FrameView previous_frame,
+    FrameView current_frame
+) {
+    CheckFrame(previous_frame);
+    CheckFrame(current_frame);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    EstimateFrame(previous_frame, current_frame);
+    return this -> current_field;
+}
+
+const MotionField& MotionEstimator::Estimate(
+    const YuvFrameView& previous_frame,
+    const YuvFrameView& current_frame
+) {
+    CheckFrame(previous_frame);
+    CheckFrame(current_frame);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    EstimateFrame(previous_frame, current_frame);
+    return this -> current_field;
+}
+
+void MotionEstimator::EstimateFrame(
+    const YuvFrameView& previous_frame,
+    const YuvFrameView& current_frame
+) {
+    EstimateFrame(
+        FrameView{previous_frame.y, _height, _width, previous_frame.y_stride},
+        FrameView{current_frame.y, _height, _width, current_frame.y_stride}
+    );
+    // The ring was rotated, [0] holds the luma planes of previous_frame now
+    ReferenceFrame& reference = *this -> _references[0];
+    CopyChroma(previous_frame.u, previous_frame.chroma_stride, previous_frame.chroma_step, getChromaHeight(), getChromaWidth(), reference.u);
+    CopyChroma(previous_frame.v, previous_frame.chroma_stride, previous_frame.chroma_step, getChromaHeight(), getChromaWidth(), reference.v);
+    reference.has_chroma = true;
+}
+
+void MotionEstimator::EstimateFrame(
+    FrameView previous_frame,
+    FrameView current_frame
+) {
+    auto [previous_ptr, current_ptr] = ReadableFrames(previous_frame, current_frame);
+    EstimateFrame(previous_ptr, current_ptr);
+}
+
+std::pair<unsigned char*, unsigned char*> MotionEstimator::ReadableFrames(
+    FrameView previous_frame,
+    FrameView current_frame
+) {
+    unsigned char* previous_ptr = const_cast<unsigned char*>(previous_frame.data);
+    unsigned char* current_ptr = const_cast<unsigned char*>(current_frame.data);
+    if (previous_frame.stride != this -> _width) {
+        std::swap(this -> _reference_copy, this -> _current_copy);
+        this -> _reference_copy.resize(getPaddedFrameSize());
+        CopyFrame(previous_frame, _reference_copy.data());
+        previous_ptr = _reference_copy.data();
+    }
+    // Blocks on the bottom and right edge are read whole
+    if (current_frame.stride != this -> _width || _height % _block_size != 0 || _width % _block_size != 0) {
+        this -> _current_copy.resize(getPaddedFrameSize());
+        CopyFrame(current_frame, _current_copy.data());
+        current_ptr = _current_copy.data();
+    }
+    return {previous_ptr, current_ptr};
+}
+
+const MotionField& MotionEstimator::EstimateBidirectional(
+    FrameView past_frame,
+    FrameView current_frame,
+    FrameView future_frame
+) {
+    CheckFrame(past_frame);
+    CheckFrame(current_frame);
+    CheckFrame(future_frame);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    EstimateBidirectionalFrame(past_frame, current_frame, future_frame);
+    return this -> current_field;
+}
+
+void MotionEstimator::EstimateBidirectionalFrame(
+    FrameView past_frame,
+    FrameView current_frame,
+    FrameView future_frame
+) {
+    auto [past_ptr, current_ptr] = ReadableFrames(past_frame, current_frame);
+    this -> _future_copy.resize(getPaddedFrameSize());
+    CopyFrame(future_frame, _future_copy.data());
+    EstimateBidirectionalFrame(past_ptr, current_ptr, _future_copy.data());
+}
+
+void MotionEstimator::EstimateBidirectionalFrame(
+    unsigned char* past_frame_ptr,
+    unsigned char* current_frame_ptr,
+    unsigned char* future_frame_ptr
+) {
+    EstimateFrame(past_frame_ptr, current_frame_ptr);
+
+    // The future reference is a ring of its own, with a single slot. While
+    // it is swapped in, the backward pass runs exactly like the forward one.
+    auto phase_start = std::chrono::steady_clock::now();
+    std::swap(this -> _references, this -> _future_references);
+    std::swap(this -> _references_filled, this -> _future_filled);
+    BuildReference(future_frame_ptr, false);
+    // EstimateFrame left the block sums of the current frame in place
+    Matrix current_frame = Matrix(current_frame_ptr, this -> _height, this -> _width);
+    if (this -> _elimination_level > 0) {
+        current_frame.setSums(&this -> current_frame_precomputed);
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.subpel_ms += ElapsedMs(phase_start);
+    }
+
+    // A block keeps moving the same way, so it is seeded where its forward
+    // vector points when mirrored into the future. Vectors into older
+    // references span more than one frame and seed nothing.
+    for (int row = 0; row < _blocks_per_column; row++) {
+        for (int column = 0; column < _blocks_per_row; column++) {
+            int cell = current_field.Cell(row, column);
+            auto& seed = this -> _seeds[row * _blocks_per_row + column];
+            if (current_field._reference[cell] == 0) {
+                seed = {-current_field._dy[cell], -current_field._dx[cell]};
+            } else {
+                seed = {0, 0};
+            }
+        }
+    }
+    this -> _seeded = true;
+
+    // The temporal candidates of the backward pass come from the last
+    // backward field
+    this -> previous_backward_field = this -> backward_field;
+    std::swap(this -> current_field, this -> backward_field);
+    std::swap(this -> previous_field, this -> previous_backward_field);
+    SearchBlocks(current_frame);
+    std::swap(this -> previous_field, this -> previous_backward_field);
+    std::swap(this -> current_field, this -> backward_field);
+    std::swap(this -> _references_filled, this -> _future_filled);
+    std::swap(this -> _references, this -> _future_references);
+}
+
+void MotionEstimator::RemapBidirectional(unsigned char* out, ptrdiff_t stride) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    RemapBidirectionalFrame(out, stride);
+}
+
+QualityMetrics MotionEstimator::RemapBidirectional(unsigned char* out, ptrdiff_t stride, FrameView current_frame) {
+    CheckFrame(current_frame);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    return RemapBidirectionalFrame(out, stride, current_frame);
+}
+
+void MotionEstimator::Remap(unsigned char* out, ptrdiff_t stride) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    RemapFrame(out, stride);
+}
+
+void MotionEstimator::Remap(const YuvOutputView& out) {
+    CheckFrame(out);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    RemapFrame(out);
+}
+
+QualityMetrics MotionEstimator::Remap(unsigned char* out, ptrdiff_t stride, FrameView current_frame) {
+    CheckFrame(current_frame);
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    return RemapFrame(out, stride, current_frame);
+}
+
+void MotionEstimator::EstimateFrame(
+    unsigned char* previous_frame_ptr,
+    unsigned char* current_frame_ptr
+) {
+    // Same size, so the copy does not allocate. Every block of current_field
+    // is overwritten below, by index, so that rows can be filled concurrently.
+    this -> previous_field = this -> current_field;
+    this -> _frame_stats = FrameStats();
+    auto phase_start = std::chrono::steady_clock::now();
     
     // For every block in current_frame we have to find corresponding (the closest)
     // block in the previous_frame
-    unsigned char* previous_frame_ptr = static_cast<unsigned char*>(_previous_frame.request().ptr);
-    unsigned char* current_frame_ptr = static_cast<unsigned char*>(_current_frame.request().ptr);
 
-    // If we want to extend borders
+    // Only the pyramid and the block sums of the unpadded frame are built for
+    // both roles, the hashes are not worth it for anything else
+    bool cacheable = this -> _pyramid_levels > 1 || (this -> _elimination_level > 0 && !this -> _extend_borders);
+    bool reuse = false;
+    uint64_t current_hash = 0;
+    if (cacheable) {
+        reuse = previous_frame_ptr == _derived_cache.frame && HashFrame(previous_frame_ptr) == _derived_cache.hash;
+        current_hash = HashFrame(current_frame_ptr);
+    }
 
-    // ExtendBorders(previous_frame_ptr, previous_extended);
-    // previous_frame_ptr = previous_extended; 
-    // int first_row_offset = new_width * border_size + border_size; 
-    // frames = {Matrix(previous_extended, this -> new_height, this -> new_width, first_row_offset, this -> border_size)};
- 
-    frames = {Matrix(previous_frame_ptr, this -> _height, this -> _width)};
+    phase_start = std::chrono::steady_clock::now();
+    BuildReference(previous_frame_ptr, reuse && !this -> _extend_borders && _derived_cache.elimination_level == this -> _elimination_level);
+    Matrix current_frame = Matrix(current_frame_ptr, this -> _height, this -> _width);
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.subpel_ms = ElapsedMs(phase_start);
+    }
+    if (this -> _elimination_level > 0) {
+        this -> current_frame_precomputed.Build(current_frame, _elimination_level > 1);
+        current_frame.setSums(&this -> current_frame_precomputed);
+    }
+
+    for (auto& context : this -> _contexts) {
+        context._stats = SearchStats();
+    }
+    if (this -> _effort_map) {
+        this -> _effort.assign(size_t(_blocks_per_column) * _blocks_per_row, 0);
+    }
+
+    if (this -> _pyramid_levels > 1) {
+        phase_start = std::chrono::steady_clock::now();
+        EstimatePyramid(previous_frame_ptr, current_frame_ptr, reuse && _derived_cache.pyramid_levels == this -> _pyramid_levels);
+        if constexpr (stats_enabled) {
+            this -> _frame_stats.pyramid_ms = ElapsedMs(phase_start);
+        }
+    }
+    this -> _seeded = this -> _pyramid_levels > 1;
+
+    this -> _derived_cache.frame = cacheable ? current_frame_ptr : nullptr;
+    this -> _derived_cache.hash = current_hash;
+    this -> _derived_cache.pyramid_levels = this -> _pyramid_levels;
+    this -> _derived_cache.elimination_level = this -> _elimination_level;
+
+    SearchBlocks(current_frame);
+}
+
+void MotionEstimator::SearchBlocks(const Matrix& current_frame) {
+    // The search method is resolved here, the block loops below do not branch on it
+    BlockEstimator estimate_block = SelectBlockEstimator();
+
+    auto start = std::chrono::steady_clock::now();
+    if (this -> _change_detection) {
+        DetectChanges(current_frame);
+    }
+    auto search_block = [&](SearchContext& context, int row, int column) {
+        int h = row * this -> _block_size, w = column * this -> _block_size;
+        int block = row * _blocks_per_row + column;
+        if (!_region_of_interest.empty() && !_region_of_interest[block]) {
+            this -> current_field.Store(row, column, MotionVector(h, w, std::numeric_limits<int>::max(), 0));
+        } else if (!_changed.empty() && !_changed[block]) {
+            context.Count(&SearchStats::unchanged);
+            this -> current_field.Store(row, column, MotionVector(h, w, 0, 0));
+        } else {
+            StoreBlock(context, row, column, (this ->* estimate_block)(context, current_frame, h, w));
+        }
+    };
+    if (this -> _thread_count <= 1) {
+        SearchContext& context = this -> _contexts[0];
+        for (int row = 0; row < _blocks_per_column; row++) {
+            for (int column = 0; column < _blocks_per_row; column++) {
+                search_block(context, row, column);
+            }
+        }
+    } else {
+        // Wavefront: rows are taken in order, and block (row, column) waits for
+        // block (row - 1, column + 1), the last neighbour GetCandidates reads.
+        for (int row = 0; row < _blocks_per_column; row++) {
+            _row_progress[row].store(0, std::memory_order_relaxed);
+        }
+        std::atomic<int> next_row(0);
+        // Set if a block threw. Its row never completes, so the workers
+        // waiting for it give up and Run rethrows the exception.
+        std::atomic<bool> aborted(false);
+        this -> _thread_pool -> Run([&](size_t thread_index) {
+            SearchContext& context = this -> _contexts[thread_index];
+            for (int row = next_row++; row < _blocks_per_column; row = next_row++) {
+                for (int column = 0; column < _blocks_per_row; column++) {
+                    if (row > 0) {
+                        int needed = std::min(column + 2, _blocks_per_row);
+                        while (_row_progress[row - 1].load(std::memory_order_acquire) < needed) {
+                            if (aborted.load(std::memory_order_relaxed)) {
+                                return;
+                            }
+                            std::this_thread::yield();
+                        }
+                    }
+                    try {
+                        search_block(context, row, column);
+                    } catch (...) {
+                        aborted.store(true, std::memory_order_relaxed);
+                        throw;
+                    }
+                    _row_progress[row].store(column + 1, std::memory_order_release);
+                }
+            }
+        });
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.search_ms += ElapsedMs(start);
+    }
+    // Whatever was counted since the last call, the pyramid included
+    for (auto& context : this -> _contexts) {
+        this -> _frame_stats.search.Add(context._stats);
+        context._stats = SearchStats();
+    }
+}
+
+void MotionEstimator::DetectChanges(const Matrix& current_frame) {
+    // One pass over both frames, eight pixels at a time. The differences of
+    // a block row are OR-ed together, a block is left alone once it differs.
+    const Matrix& reference = this -> _references[0] -> planes[0];
+    this -> _changed.assign(size_t(_blocks_per_column) * _blocks_per_row, 0);
+    for (int h = 0; h < this -> _height; h++) {
+        const unsigned char* current = current_frame.ptr(h, 0);
+        const unsigned char* previous = reference.ptr(h, 0);
+        uint8_t* changed = this -> _changed.data() + (h / this -> _block_size) * _blocks_per_row;
+        for (int column = 0; column < _blocks_per_row; column++) {
+            if (changed[column]) {
+                continue;
+            }
+            int left = column * this -> _block_size, right = std::min(left + this -> _block_size, this -> _width);
+            uint64_t difference = 0;
+            int w = left;
+            for (; w + 8 <= right; w += 8) {
+                uint64_t a, b;
+                memcpy(&a, current + w, sizeof(a));
+                memcpy(&b, previous + w, sizeof(b));
+                difference |= a ^ b;
+            }
+            for (; w < right; w++) {
+                difference |= current[w] ^ previous[w];
+            }
+            changed[column] = difference != 0;
+        }
+    }
+}
+
+void MotionEstimator::BuildReference(unsigned char* previous_frame, bool reuse_sums) {
+    std::rotate(_references.begin(), _references.end() - 1, _references.end());
+    this -> _references_filled = std::min<int>(_references_filled + 1, _references.size());
+    // Searched again by the next Estimate calls, after the caller let go
+    BuildPlanes(*this -> _references[0], previous_frame, this -> _references.size() > 1, reuse_sums);
+}
+
+void MotionEstimator::BuildPlanes(ReferenceFrame& reference, unsigned char* frame, bool copy, bool reuse_sums) {
+    // If we want to extend borders, every reference plane is padded. The
+    // half-pixel planes are interpolated from the padded frame, which gives
+    // the same pixels inside of the picture as the unpadded interpolation.
+    // Estimate of YUV frames copies the chroma afterwards
+    reference.has_chroma = false;
+    unsigned char* reference_ptr = frame;
+    int reference_height = this -> _height, reference_width = this -> _width;
+    int border = 0;
+    if (this -> _extend_borders) {
+        reference.pixels.resize(size_t(new_height) * new_width);
+        ExtendBorders(frame, reference.pixels.data());
+        reference_ptr = reference.pixels.data();
+        reference_height = this -> new_height;
+        reference_width = this -> new_width;
+        border = this -> border_size;
+    } else if (copy) {
+        reference.pixels.assign(frame, frame + size_t(_height) * _width);
+        reference_ptr = reference.pixels.data();
+    }
+
+    reference.planes = {Matrix(reference_ptr, this -> _height, this -> _width, reference_width, border)};
     if (_use_halfpixel) {
-        GenerateSubpixelArrays(
-            previous_frame_ptr,
-            this -> previous_up,
-            this -> previous_left,
-            this -> previous_up_left,
-            this -> _height,
-            this -> _width
-        );
-        this -> frames.push_back(Matrix(this -> previous_up, this -> _height, this -> _width));
-        this -> frames.push_back(Matrix(this -> previous_left, this -> _height, this -> _width));
-        this -> frames.push_back(Matrix(this -> previous_up_left, this -> _height, this -> _width));
+        size_t plane_size = size_t(reference_height) * reference_width;
+        reference.up.resize(plane_size);
+        reference.left.resize(plane_size);
+        reference.up_left.resize(plane_size);
+        if (this -> _lazy_halfpel) {
+            reference.tiles.Reset(
+                reference_ptr,
+                reference.up.data(),
+                reference.left.data(),
+                reference.up_left.data(),
+                reference_height,
+                reference_width,
+                border
+            );
+        } else {
+            GenerateSubpixelArrays(
+                reference_ptr,
+                reference.up.data(),
+                reference.left.data(),
+                reference.up_left.data(),
+                reference_height,
+                reference_width
+            );
+        }
+        reference.planes.push_back(Matrix(reference.up.data(), this -> _height, this -> _width, reference_width, border));
+        reference.planes.push_back(Matrix(reference.left.data(), this -> _height, this -> _width, reference_width, border));
+        reference.planes.push_back(Matrix(reference.up_left.data(), this -> _height, this -> _width, reference_width, border));
+        if (this -> _lazy_halfpel) {
+            for (size_t i = 1; i < reference.planes.size(); i++) {
+                reference.planes[i].setTiles(&reference.tiles);
+            }
+        }
     }
 
-    Matrix current_frame = Matrix(current_frame_ptr, this -> _height, this -> _width);
+    if (this -> _elimination_level > 0) {
+        reference.sums.resize(reference.planes.size());
+        for (size_t i = 0; i < reference.planes.size(); i++) {
+            if (i == 0 && reuse_sums) {
+                std::swap(reference.sums[0], this -> current_frame_precomputed);
+            } else {
+                // The block sums cover the whole plane, so nothing is left to defer
+                if (reference.planes[i].getTiles()) {
+                    reference.planes[i].getTiles() -> EnsureAll();
+                }
+                reference.sums[i].Build(reference.planes[i], _elimination_level > 1);
+            }
+            reference.planes[i].setSums(&reference.sums[i]);
+        }
+    }
+}
 
-    for (int h = 0; h < this -> _height; h += this -> _block_size) {
-        for (int w = 0; w < this -> _width; w += this -> _block_size) {
-            MotionVector found_motion_vector = MotionVector(0, 0, std::numeric_limits<int>::max(), 0);
-            for (int shift_dir = 0; shift_dir < frames.size(); shift_dir++, this -> _iteration_count = 0) {
-                MotionVector candidate = GetCandidates(frames[shift_dir], current_frame, h, w);
-                if (candidate._error < this -> candidate_threshold) {
-                    candidate.shift_dir = shift_dir;
+void MotionEstimator::ForgetReferences() {
+    this -> _references_filled = 0;
+}
+
+template<size_t mode, bool use_halfpixel>
+MotionVector MotionEstimator::EstimateBlock(
+    SearchContext& context,
+    const Matrix& current_frame,
+    int h,
+    int w
+) {
+    // The random update sequence depends on the block only, so that every
+    // thread count produces the same field.
+    int block_index = (h / this -> _block_size) * _blocks_per_row + w / this -> _block_size;
+    uint64_t evaluations = context._stats.evaluations;
+    context._3DRS_offset_index = (block_index * _3DRS_current_frame_offset.size()) % _3DRS_random_fluctuations.size();
+
+    // Start of the refinement, the co-located block unless the seed, from the
+    // pyramid or the forward field, matches better
+    int start_h = h, start_w = w;
+    if (this -> _seeded) {
+        const auto& seed = _seeds[block_index];
+        const Matrix& nearest = this -> _references[0] -> planes[0];
+        int zero_error = ScoreCandidate(context, nearest, h, w, current_frame, h, w, this -> _block_size);
+        if (ScoreCandidate(context, nearest, h + seed.first, w + seed.second, current_frame, h, w, this -> _block_size, zero_error) < zero_error) {
+            start_h += seed.first;
+            start_w += seed.second;
+        }
+    }
+
+    context._smallest_block = this -> _min_block_size;
+    context._partition.Reset(h, w, this -> _block_size, this -> _min_block_size);
+    context._best_partition.Reset(h, w, this -> _block_size, this -> _min_block_size);
+
+    constexpr int plane_count = use_halfpixel ? 4 : 1;
+    // Blocks cut by the frame border score max() everywhere, they keep the
+    // co-located block
+    MotionVector found_motion_vector = MotionVector(h, w, std::numeric_limits<int>::max(), 0);
+    for (int reference = 0; reference < this -> _references_filled; reference++) {
+        // Older references only pay off where the nearest one matched badly,
+        // behind an occlusion or a flash
+        if (reference > 0) {
+            if (found_motion_vector._error < ExitThreshold(this -> _reference_threshold, this -> _block_size)) {
+                break;
+            }
+            if (reference == 1) {
+                context.Count(&SearchStats::reference_searches);
+            }
+        }
+        const std::vector<Matrix>& frames = this -> _references[reference] -> planes;
+        for (int shift_dir = 0; shift_dir < plane_count; shift_dir++) {
+            context.BeginSearch(h, w);
+            MotionVector candidate = GetCandidates(context, frames[shift_dir], current_frame, h, w);
+            if (candidate._error < ExitThreshold(this -> candidate_threshold, this -> _block_size)) {
+                candidate.shift_dir = shift_dir;
+                candidate.reference = reference;
+                if (candidate._error < found_motion_vector._error) {
                     found_motion_vector = candidate;
-                    break;
                 }
-                MotionVector motion_vector = this -> FindBlock_DiamondSearch(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max(), this -> _block_size, shift_dir);
-                // if (this -> SEARCH_MODE == MODE::BruteForce) {
-                //     motion_vector = this -> FindBlock_BruteForce(frames[shift_dir], current_frame, h, w, h, w);
-                // } else if (this -> SEARCH_MODE == MODE::CrossSearch) {
-                //     motion_vector = this -> FindBlock_CrossSearch(frames[shift_dir], current_frame, h, w, this -> _cross_search_side, h, w, std::numeric_limits<int>::max(), this -> _block_size);
-                // } else if (this -> SEARCH_MODE == MODE::OrthonormalSearch) {
-                //     motion_vector = this -> FindBlock_OrthonormalSearch(frames[shift_dir], current_frame, h, w, this -> _orthonormal_search_step_size, h, w, std::numeric_limits<int>::max(), true);
-                // } else if (this -> SEARCH_MODE == MODE::_3DRS) {
-                //     motion_vector = this -> FindBlock_3DRS(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max());
-                // } else if (this -> SEARCH_MODE == MODE::ThreeStepSearch) {
-                //     motion_vector = this -> FindBlock_ThreeStepSearch(frames[shift_dir], current_frame, h, w, this -> _three_step_search_side, h, w, std::numeric_limits<int>::max());
-                // } else if (this -> SEARCH_MODE == MODE::DiamondSearch) {
-                //     motion_vector = this -> FindBlock_DiamondSearch(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max(), this -> _block_size, shift_dir);
-                // } else if(this -> SEARCH_MODE == MODE::HexagonSearch) {
-                //     motion_vector = this -> FindBlock_HexagonSearch(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max(), this -> _block_size);
-                // }
-                if (motion_vector._error < found_motion_vector._error) {
-                    found_motion_vector = motion_vector;
+                break;
+            }
+            MotionVector motion_vector;
+            if constexpr (mode == MODE::BruteForce) {
+                motion_vector = this -> FindBlock_BruteForce(context, frames[shift_dir], current_frame, h, w, start_h, start_w);
+            } else if constexpr (mode == MODE::CrossSearch) {
+                motion_vector = WithBlockSize(this -> _block_size, [&]<int block_size>() {
+                    return this -> FindBlock_CrossSearch<block_size>(context, frames[shift_dir], current_frame, h, w, this -> _cross_search_side, start_h, start_w, std::numeric_limits<int>::max());
+                });
+            } else if constexpr (mode == MODE::OrthonormalSearch) {
+                motion_vector = this -> FindBlock_OrthonormalSearch(context, frames[shift_dir], current_frame, h, w, this -> _orthonormal_search_step_size, start_h, start_w, std::numeric_limits<int>::max(), true);
+            } else if constexpr (mode == MODE::_3DRS) {
+                motion_vector = this -> FindBlock_3DRS(context, frames[shift_dir], current_frame, h, w, start_h, start_w, std::numeric_limits<int>::max());
+            } else if constexpr (mode == MODE::ThreeStepSearch) {
+                motion_vector = this -> FindBlock_ThreeStepSearch(context, frames[shift_dir], current_frame, h, w, this -> _three_step_search_side, start_h, start_w, std::numeric_limits<int>::max());
+            } else if constexpr (mode == MODE::DiamondSearch) {
+                motion_vector = WithBlockSize(this -> _block_size, [&]<int block_size>() {
+                    return this -> FindBlock_DiamondSearch<block_size>(context, frames[shift_dir], current_frame, h, w, start_h, start_w, std::numeric_limits<int>::max(), shift_dir);
+                });
+            } else if constexpr (mode == MODE::HexagonSearch) {
+                motion_vector = WithBlockSize(this -> _block_size, [&]<int block_size>() {
+                    return this -> FindBlock_HexagonSearch<block_size>(context, frames[shift_dir], current_frame, h, w, start_h, start_w, std::numeric_limits<int>::max());
+                });
+            }
+            // Only the diamond search knows the plane it searches in
+            motion_vector.shift_dir = shift_dir;
+            motion_vector.reference = reference;
+            if (motion_vector._splitted) {
+                context._partition.SetPlane(reference, shift_dir);
+            }
+            if (motion_vector._error < found_motion_vector._error) {
+                found_motion_vector = motion_vector;
+                // The next plane writes its leaves into the other partition
+                if (motion_vector._splitted) {
+                    std::swap(context._partition, context._best_partition);
                 }
             }
-            this -> current_storage.emplace_back(found_motion_vector);
         }
     }
-    return; 
+    if (this -> _effort_map) {
+        // Both passes of a bidirectional Estimate add up
+        this -> _effort[block_index] += uint32_t(context._stats.evaluations - evaluations);
+    }
+    return found_motion_vector;
 }
 
-py::array_t<unsigned char> MotionEstimator::Remap(
-    py::array_t<unsigned char> _previous_frame
+void MotionEstimator::StoreBlock(SearchContext& context, int row, int column, const MotionVector& motion_vector) {
+    if (motion_vector._splitted) {
+        this -> current_field.Store(row, column, context._best_partition);
+    } else {
+        this -> current_field.Store(row, column, motion_vector);
+    }
+}
+
+MotionEstimator::BlockEstimator MotionEstimator::SelectBlockEstimator() const {
+    #define SPECIALISE(mode) (_use_halfpixel ? &MotionEstimator::EstimateBlock<mode, true> \
+                                             : &MotionEstimator::EstimateBlock<mode, false>)
+    switch (this -> SEARCH_MODE) {
+        case MODE::BruteForce: return SPECIALISE(MODE::BruteForce);
+        case MODE::CrossSearch: return SPECIALISE(MODE::CrossSearch);
+        case MODE::OrthonormalSearch: return SPECIALISE(MODE::OrthonormalSearch);
+        case MODE::_3DRS: return SPECIALISE(MODE::_3DRS);
+        case MODE::ThreeStepSearch: return SPECIALISE(MODE::ThreeStepSearch);
+        case MODE::HexagonSearch: return SPECIALISE(MODE::HexagonSearch);
+        default: return SPECIALISE(MODE::DiamondSearch);
+    }
+    #undef SPECIALISE
+}
+
+void MotionEstimator::Downsample(
+    const unsigned char* input,
+    unsigned char* output,
+    int height,
+    int width
 ) {
-    py::array_t<unsigned char> result(this -> _height * this -> _width);
-    unsigned char* result_ptr = static_cast<unsigned char*>(result.request().ptr);
-    
-    int index = 0;
-    for (int h = 0; h < this -> _height; h += this -> _block_size) {
-        for (int w = 0; w < this -> _width; w += this -> _block_size, index++) {
-            if (current_storage[index]._splitted) {
-                int block_size = 8;
-                std::array<std::pair<int, int>, 4> shifts = {
-                    {{0, 0},         {0, block_size},
-                    {block_size, block_size},{block_size, 0}}
-                };
-                for (int i = 0; i < 4; i++) {
-                    int shift_dir = current_storage[index]._subvectors[i].shift_dir;
-                    AssignBlock(result_ptr, h + shifts[i].first, w + shifts[i].second, current_storage[index]._subvectors[i], this -> frames[shift_dir], block_size);
+    int new_height = height >> 1, new_width = width >> 1;
+    for (int y = 0; y < new_height; ++y) {
+        const unsigned char* top = input + 2 * y * width;
+        const unsigned char* bottom = top + width;
+        for (int x = 0; x < new_width; ++x) {
+            output[y * new_width + x] = (
+                int(top[2 * x]) + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2
+            ) >> 2;
+        }
+    }
+}
+
+uint64_t MotionEstimator::HashFrame(const unsigned char* frame) const {
+    // Four independent lanes of multiply-xor over 64-bit words, so the
+    // multiplications overlap and the pass runs at memory speed
+    constexpr uint64_t prime = 0x9E3779B97F4A7C15ull;
+    uint64_t lanes[4] = {1, 2, 3, 4};
+    size_t size = size_t(this -> _height) * this -> _width;
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, frame + i + 8 * lane, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * prime;
+        }
+    }
+    uint64_t hash = size;
+    for (; i < size; i++) {
+        hash = (hash ^ frame[i]) * prime;
+    }
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ (lanes[lane] >> 29) ^ lanes[lane]) * prime;
+    }
+    return hash;
+}
+
+void MotionEstimator::EstimatePyramid(
+    const unsigned char* previous_frame,
+    const unsigned char* current_frame,
+    bool reuse_previous
+) {
+    // The levels of the last current frame are those of the new reference
+    if (reuse_previous) {
+        std::swap(this -> _previous_pyramid, this -> _current_pyramid);
+    }
+    for (int level = 1; level < this -> _pyramid_levels; level++) {
+        if (!reuse_previous) {
+            Downsample(
+                level == 1 ? previous_frame : _previous_pyramid[level - 2].data(),
+                _previous_pyramid[level - 1].data(),
+                this -> _height >> (level - 1),
+                this -> _width >> (level - 1)
+            );
+        }
+        Downsample(
+            level == 1 ? current_frame : _current_pyramid[level - 2].data(),
+            _current_pyramid[level - 1].data(),
+            this -> _height >> (level - 1),
+            this -> _width >> (level - 1)
+        );
+    }
+
+    std::fill(_seeds.begin(), _seeds.end(), std::make_pair(0, 0));
+    for (int level = this -> _pyramid_levels - 1; level > 0; level--) {
+        Matrix previous_level(_previous_pyramid[level - 1].data(), this -> _height >> level, this -> _width >> level);
+        Matrix current_level(_current_pyramid[level - 1].data(), this -> _height >> level, this -> _width >> level);
+        int block_size = this -> _block_size >> level;
+
+        // Blocks of one level are independent, rows are simply shared out
+        std::atomic<int> next_row(0);
+        this -> _thread_pool -> Run([&](size_t thread_index) {
+            SearchContext& context = this -> _contexts[thread_index];
+            for (int row = next_row++; row < _blocks_per_column; row = next_row++) {
+                int h = row * block_size;
+                if (h + block_size > current_level.getHeight()) {
+                    continue;
+                }
+                for (int column = 0; column < _blocks_per_row; column++) {
+                    int w = column * block_size;
+                    if (w + block_size > current_level.getWidth()) {
+                        continue;
+                    }
+                    int block_index = row * _blocks_per_row + column;
+                    auto& seed = _seeds[block_index];
+                    uint64_t evaluations = context._stats.evaluations;
+                    // Seeds only need a vector, the pyramid blocks are never split
+                    context._smallest_block = block_size;
+                    context.BeginSearch(h, w);
+                    MotionVector motion_vector;
+                    if (level == this -> _pyramid_levels - 1) {
+                        // A descent from the zero vector stops in the first
+                        // local minimum, and large motions are what the
+                        // pyramid is for. Ties keep the shorter vector.
+                        motion_vector = MotionVector(h, w, ScoreCandidate(context, previous_level, h, w, current_level, h, w, block_size));
+                        for (int distance = 1; distance <= _pyramid_search_range; distance++) {
+                            for (int dh = -distance; dh <= distance; dh++) {
+                                for (int dw = -distance; dw <= distance; dw++) {
+                                    if (std::max(std::abs(dh), std::abs(dw)) != distance) {
+                                        continue;
+                                    }
+                                    int error = ScoreCandidate(context, previous_level, h + dh, w + dw, current_level, h, w, block_size, motion_vector._error);
+                                    if (error < motion_vector._error) {
+                                        motion_vector = MotionVector(h + dh, w + dw, error);
+                                    }
+                                }
+                            }
+                        }
+                    } else {
+                        // The coarser level may have been fooled, keep the zero vector as a fallback
+                        int start_h = h, start_w = w;
+                        int zero_error = ScoreCandidate(context, previous_level, h, w, current_level, h, w, block_size);
+                        if (ScoreCandidate(context, previous_level, h + seed.first, w + seed.second, current_level, h, w, block_size, zero_error) < zero_error) {
+                            start_h += seed.first;
+                            start_w += seed.second;
+                        }
+                        motion_vector = WithBlockSize(block_size, [&]<int size>() {
+                            return FindBlock_DiamondSearch<size>(
+                                context, previous_level, current_level, h, w, start_h, start_w,
+                                std::numeric_limits<int>::max(), 0
+                            );
+                        });
+                    }
+                    // Scale to the next finer level
+                    seed = {2 * (motion_vector._h - h), 2 * (motion_vector._w - w)};
+                    if (this -> _effort_map) {
+                        this -> _effort[block_index] += uint32_t(context._stats.evaluations - evaluations);
+                    }
                 }
-            } else {
-                int shift_dir = current_storage[index].shift_dir;
-                AssignBlock(result_ptr, h, w, current_storage[index], this -> frames[shift_dir], this -> _block_size);
             }
-            // AssignBlock(result_ptr, h, w, current_storage[index], this -> _block_size);
+        });
+    }
+}
+
+void MotionEstimator::RemapFrame(unsigned char* result_ptr, ptrdiff_t stride) {
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < _blocks_per_column; row++) {
+        RemapRow(result_ptr, stride, row, this -> current_field, this -> _references);
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.remap_ms = ElapsedMs(start);
+    }
+}
+
+QualityMetrics MotionEstimator::RemapFrame(unsigned char* result_ptr, ptrdiff_t stride, FrameView target) {
+    // Every block row is measured right after it is written
+    auto start = std::chrono::steady_clock::now();
+    FrameQuality quality(this -> _height, this -> _width);
+    for (int row = 0; row < _blocks_per_column; row++) {
+        RemapRow(result_ptr, stride, row, this -> current_field, this -> _references);
+        int top = row * this -> _block_size;
+        quality.AddRows(result_ptr, stride, target.data, target.stride, top, std::min(top + this -> _block_size, this -> _height));
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.remap_ms = ElapsedMs(start);
+    }
+    return quality.Finish();
+}
+
+void MotionEstimator::RemapFrame(const YuvOutputView& result) {
+    for (int reference = 0; reference < this -> _references_filled; reference++) {
+        if (!this -> _references[reference] -> has_chroma) {
+            throw std::invalid_argument("Chroma can only be compensated after Estimate of YUV frames");
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < _blocks_per_column; row++) {
+        RemapRow(result.y, result.y_stride, row, this -> current_field, this -> _references);
+        RemapChromaRow(result, row, this -> current_field, this -> _references);
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.remap_ms = ElapsedMs(start);
+    }
+}
+
+void MotionEstimator::RemapBidirectionalFrame(unsigned char* result_ptr, ptrdiff_t stride) {
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < _blocks_per_column; row++) {
+        RemapBidirectionalRow(result_ptr, stride, row);
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.remap_ms = ElapsedMs(start);
+    }
+}
+
+QualityMetrics MotionEstimator::RemapBidirectionalFrame(unsigned char* result_ptr, ptrdiff_t stride, FrameView target) {
+    auto start = std::chrono::steady_clock::now();
+    FrameQuality quality(this -> _height, this -> _width);
+    for (int row = 0; row < _blocks_per_column; row++) {
+        RemapBidirectionalRow(result_ptr, stride, row);
+        int top = row * this -> _block_size;
+        quality.AddRows(result_ptr, stride, target.data, target.stride, top, std::min(top + this -> _block_size, this -> _height));
+    }
+    if constexpr (stats_enabled) {
+        this -> _frame_stats.remap_ms = ElapsedMs(start);
+    }
+    return quality.Finish();
+}
+
+void MotionEstimator::RemapBidirectionalRow(unsigned char* result_ptr, ptrdiff_t stride, int row) {
+    // The backward prediction goes to a frame of its own and is averaged
+    // into the forward one while both rows are still in the cache
+    this -> _backward_prediction.resize(size_t(_height) * _width);
+    unsigned char* backward = this -> _backward_prediction.data();
+    RemapRow(result_ptr, stride, row, this -> current_field, this -> _references);
+    RemapRow(backward, this -> _width, row, this -> backward_field, this -> _future_references);
+    int top = row * this -> _block_size, bottom = std::min(top + this -> _block_size, this -> _height);
+    for (int h = top; h < bottom; h++) {
+        unsigned char* forward_row = result_ptr + h * stride;
+        const unsigned char* backward_row = backward + size_t(h) * _width;
+        for (int w = 0; w < this -> _width; w++) {
+            forward_row[w] = (unsigned char)((forward_row[w] + backward_row[w] + 1) >> 1);
+        }
+    }
+}
+
+template<typename Leaf>
+void MotionEstimator::ForEachLeaf(const MotionField& field, int row, Leaf&& leaf) const {
+    int cell_size = field.getCellSize(), cells_per_block = field.getCellsPerBlock();
+    for (int column = 0; column < _blocks_per_row; column++) {
+        int h = row * this -> _block_size, w = column * this -> _block_size;
+        int cell = field.Cell(row, column);
+        if (!field._split[row * _blocks_per_row + column]) {
+            leaf(h, w, this -> _block_size, cell);
+            continue;
+        }
+        // Every leaf is found at its top-left cell
+        for (int cell_row = 0; cell_row < cells_per_block; cell_row++) {
+            for (int cell_column = 0; cell_column < cells_per_block; cell_column++) {
+                int leaf_cell = cell + cell_row * field.getColumns() + cell_column;
+                int leaf_size = this -> _block_size >> field._depth[leaf_cell];
+                int top = h + cell_row * cell_size, left = w + cell_column * cell_size;
+                if ((top - h) % leaf_size != 0 || (left - w) % leaf_size != 0) {
+                    continue;
+                }
+                leaf(top, left, leaf_size, leaf_cell);
+            }
+        }
+    }
+}
+
+void MotionEstimator::RemapRow(
+    unsigned char* result_ptr,
+    ptrdiff_t stride,
+    int row,
+    const MotionField& field,
+    const ReferenceRing& references
+) {
+    ForEachLeaf(field, row, [&](int top, int left, int size, int cell) {
+        MotionVector motion_vector(top + field._dy[cell], left + field._dx[cell]);
+        const Matrix& plane = references[field._reference[cell]] -> planes[field._phase[cell]];
+        AssignBlock(result_ptr, stride, top, left, motion_vector, plane, size);
+    });
+}
+
+void MotionEstimator::RemapChromaRow(
+    const YuvOutputView& result,
+    int row,
+    const MotionField& field,
+    const ReferenceRing& references
+) {
+    ForEachLeaf(field, row, [&](int top, int left, int size, int cell) {
+        // The up and left half-pixel planes sample half a pixel above and
+        // to the left of the full-pixel position
+        int phase = field._phase[cell];
+        int dy = 2 * field._dy[cell] - (phase & 1);
+        int dx = 2 * field._dx[cell] - (phase >> 1);
+        const ReferenceFrame& reference = *references[field._reference[cell]];
+        AssignChromaBlock(result.u, result.chroma_stride, result.chroma_step, reference.u.data(), top, left, size, dy, dx);
+        AssignChromaBlock(result.v, result.chroma_stride, result.chroma_step, reference.v.data(), top, left, size, dy, dx);
+    });
+}
+
+void MotionEstimator::AssignChromaBlock(
+    unsigned char* result_ptr,
+    ptrdiff_t stride,
+    int step,
+    const unsigned char* reference,
+    int top,
+    int left,
+    int size,
+    int dy,
+    int dx
+) const {
+    int height = getChromaHeight(), width = getChromaWidth();
+    int first_row = top / 2, last_row = std::min((top + size) / 2, height);
+    int first_column = left / 2, last_column = std::min((left + size) / 2, width);
+    // Integer and quarter-sample parts, the weights of the four neighbours
+    // sum up to 16
+    int offset_h = dy >> 2, offset_w = dx >> 2;
+    int fraction_h = dy & 3, fraction_w = dx & 3;
+    // Vectors may point outside of the picture, the border samples repeat
+    // like in the extended luma planes
+    auto clamp_row = [height](int h) { return std::clamp(h, 0, height - 1); };
+    auto clamp_column = [width](int w) { return std::clamp(w, 0, width - 1); };
+    for (int h = first_row; h < last_row; h++) {
+        const unsigned char* upper = reference + size_t(clamp_row(h + offset_h)) * width;
+        const unsigned char* lower = reference + size_t(clamp_row(h + offset_h + 1)) * width;
+        unsigned char* destination = result_ptr + h * stride;
+        for (int w = first_column; w < last_column; w++) {
+            int w0 = clamp_column(w + offset_w), w1 = clamp_column(w + offset_w + 1);
+            int value = (4 - fraction_h) * ((4 - fraction_w) * upper[w0] + fraction_w * upper[w1]) +
+                        fraction_h * ((4 - fraction_w) * lower[w0] + fraction_w * lower[w1]);
+            destination[w * step] = (unsigned char)((value + 8) >> 4);
+        }
+    }
+}
+
+void MotionEstimator::EstimateBatch(
+    const std::vector<FrameView>& frames,
+    const std::function<void(int, const MotionField&)>& store
+) {
+    for (const auto& frame : frames) {
+        CheckFrame(frame);
+    }
+    if (frames.size() < 2) {
+        throw std::invalid_argument("EstimateBatch needs at least two frames");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    EstimateSequence(frames, store);
+}
+
+void MotionEstimator::EstimateSequence(
+    const std::vector<FrameView>& frames,
+    const std::function<void(int, const MotionField&)>& store
+) {
+    int pairs = int(frames.size()) - 1;
+    // 3DRS takes candidates from the field of the previous pair, which took
+    // them from the pair before, back to the first one. No warm-up short of
+    // the whole stream rebuilds that field, so the stream is one chunk and
+    // the threads share the rows of every frame instead.
+    bool temporal = this -> SEARCH_MODE == MODE::_3DRS;
+    int chunks = temporal ? std::min(pairs, 1) : std::min<int>(this -> _thread_count, pairs);
+    if (chunks <= 0) {
+        return;
+    }
+    std::vector<std::unique_ptr<MotionEstimator>> estimators;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        estimators.push_back(CloneSettings());
+    }
+    if (temporal) {
+        estimators[0] -> setThreadCount(this -> _thread_count);
+    }
+    // One chunk per worker, chunk sizes differ by one pair at most
+    this -> _thread_pool -> Run([&](size_t worker) {
+        if (int(worker) >= chunks) {
+            return;
+        }
+        MotionEstimator& estimator = *estimators[worker];
+        int begin = pairs * int(worker) / chunks;
+        int end = pairs * int(worker + 1) / chunks;
+        // The previous frame is read again by RemapFrame and the next pair,
+        // so the two padded copies take turns
+        std::vector<unsigned char> buffers[2];
+        auto load = [&](int frame, int buffer) {
+            buffers[buffer].resize(getPaddedFrameSize());
+            CopyFrame(frames[frame], buffers[buffer].data());
+            return buffers[buffer].data();
+        };
+        // Warm-up: the pairs before the chunk rebuild the reference ring.
+        // With a single reference the pairs are independent.
+        int warm_up = int(estimator._references.size()) - 1;
+        int first = std::max(begin - warm_up, 0);
+        unsigned char* previous = load(first, 0);
+        for (int pair = first; pair < end; pair++) {
+            unsigned char* current = load(pair + 1, (pair - first + 1) & 1);
+            estimator.EstimateFrame(previous, current);
+            if (pair >= begin) {
+                store(pair, estimator.getMotionField());
+            }
+            previous = current;
+        }
+    });
+}
+
+void MotionEstimator::PadFrame(unsigned char* frame) const {
+    int padded_height = _blocks_per_column * _block_size;
+    for (int h = _height; h <= padded_height; h++) {
+        std::memcpy(frame + size_t(h) * _width, frame + size_t(_height - 1) * _width, _width);
+    }
+}
+
+void MotionEstimator::CopyFrame(FrameView frame, unsigned char* buffer) const {
+    if (frame.stride == this -> _width) {
+        std::memcpy(buffer, frame.data, size_t(_height) * _width);
+    } else {
+        for (int h = 0; h < this -> _height; h++) {
+            std::memcpy(buffer + size_t(h) * _width, frame.data + h * frame.stride, _width);
         }
     }
-    result.resize({this -> _height, this -> _width});
-    return result;
+    PadFrame(buffer);
+}
+
+std::unique_ptr<MotionEstimator> MotionEstimator::CloneSettings() const {
+    std::unique_ptr<MotionEstimator> estimator(new MotionEstimator(_width, _height, _quality, _use_halfpixel, _block_size, _min_block_size));
+    estimator -> SEARCH_MODE = this -> SEARCH_MODE;
+    estimator -> _split_share = this -> _split_share;
+    estimator -> _elimination_level = this -> _elimination_level;
+    estimator -> _extend_borders = this -> _extend_borders;
+    estimator -> _lazy_halfpel = this -> _lazy_halfpel;
+    estimator -> _visited_cache = this -> _visited_cache;
+    estimator -> _effort_map = this -> _effort_map;
+    estimator -> _change_detection = this -> _change_detection;
+    estimator -> _region_of_interest = this -> _region_of_interest;
+    estimator -> _cross_search_side = this -> _cross_search_side;
+    estimator -> _cross_search_error_threshold = this -> _cross_search_error_threshold;
+    estimator -> _pyramid_levels = this -> _pyramid_levels;
+    estimator -> _reference_threshold = this -> _reference_threshold;
+    while (estimator -> _references.size() < this -> _references.size()) {
+        estimator -> _references.push_back(std::make_unique<ReferenceFrame>());
+    }
+    estimator -> _previous_pyramid = this -> _previous_pyramid;
+    estimator -> _current_pyramid = this -> _current_pyramid;
+    estimator -> _seeds = this -> _seeds;
+    return estimator;
 }
 
 void MotionEstimator::AssignBlock(
     unsigned char* result_ptr,
+    ptrdiff_t result_stride,
     int dh,
     int dw,
     MotionVector& motion_vector,
     const Matrix& previous_frame,
     int block_size
 ) {
-    // if (motion_vector._splitted) {
-    //     std::array<std::pair<int, int>, 4> shifts = {
-    //         {{0, 0},         {0, block_size},
-    //         {block_size, block_size},{block_size, 0}}
-    //     };
-    //     for (size_t i = 0; i < 4; i++) {
-    //         AssignBlock(result_ptr, dh + shifts[i].first, dw + shifts[i].second, motion_vector._subvectors[i], block_size >> 1);
-    //     }
-    //     return;
-    // } // else it is not splitted
-    for (int h = 0; h < block_size; h++) {
-        for (int w = 0; w < block_size; w++) {
-            result_ptr[(dh + h) * this -> _width + w + dw] = previous_frame.get(h + motion_vector._h, w + motion_vector._w);
+    // Blocks on the right and bottom edge may be cut by the frame border
+    int height = std::min(block_size, this -> _height - dh);
+    int width = std::min(block_size, this -> _width - dw);
+    if (previous_frame.getTiles()) {
+        previous_frame.getTiles() -> Ensure(motion_vector._h, motion_vector._w, block_size);
+    }
+    // Every half-pixel phase has a plane of its own, so all vectors are
+    // plain row copies
+    const unsigned char* source = previous_frame.ptr(motion_vector._h, motion_vector._w);
+    unsigned char* destination = result_ptr + dh * result_stride + dw;
+    int stride = previous_frame.getStride();
+    // The common leaf sizes get fixed-size copies, which compile to single
+    // vector moves instead of library calls
+    if (width == 32) {
+        for (int h = 0; h < height; h++, source += stride, destination += result_stride) {
+            std::memcpy(destination, source, 32);
+        }
+    } else if (width == 16) {
+        for (int h = 0; h < height; h++, source += stride, destination += result_stride) {
+            std::memcpy(destination, source, 16);
+        }
+    } else if (width == 8) {
+        for (int h = 0; h < height; h++, source += stride, destination += result_stride) {
+            std::memcpy(destination, source, 8);
+        }
+    } else if (width == 4) {
+        for (int h = 0; h < height; h++, source += stride, destination += result_stride) {
+            std::memcpy(destination, source, 4);
+        }
+    } else {
+        for (int h = 0; h < height; h++, source += stride, destination += result_stride) {
+            std::memcpy(destination, source, width);
         }
     }
 }
@@ -761,13 +1916,127 @@ inline int MotionEstimator::GetKey(int h, int w) const {
     return this -> _width * h + w;
 }
 
-void MotionEstimator::set_SearchMethod(py::array_t<int> value) {
-    this -> SEARCH_MODE = *(int*)value.request().ptr;
+std::pair<uint64_t, uint64_t> MotionEstimator::get_EvaluationCount() const {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    return {_frame_stats.search.evaluations, _frame_stats.search.reused};
+}
+
+void MotionEstimator::setSearchMethod(int mode) {
+    if (mode < MODE::BruteForce || mode > MODE::HexagonSearch) {
+        throw std::invalid_argument("Unknown search method");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> SEARCH_MODE = mode;
+}
+
+void MotionEstimator::setThreadCount(int thread_count) {
+    if (thread_count <= 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _thread_count = thread_count;
+    this -> _thread_pool.reset(new ThreadPool(thread_count));
+    this -> _contexts.assign(thread_count, SearchContext());
+}
+
+void MotionEstimator::setPyramidLevels(int levels) {
+    if (levels < 1 || levels > 3) {
+        throw std::invalid_argument("Pyramid levels must be in [1, 3]");
+    }
+    // The top level is searched with blocks of _block_size >> (levels - 1)
+    if ((this -> _block_size >> (levels - 1)) < 4) {
+        throw std::invalid_argument("Pyramid levels leave blocks smaller than 4 pixels");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _pyramid_levels = levels;
+    this -> _previous_pyramid.resize(levels - 1);
+    this -> _current_pyramid.resize(levels - 1);
+    for (int level = 1; level < levels; level++) {
+        size_t size = size_t(this -> _height >> level) * (this -> _width >> level);
+        this -> _previous_pyramid[level - 1].resize(size);
+        this -> _current_pyramid[level - 1].resize(size);
+    }
+}
+
+void MotionEstimator::setSuccessiveElimination(int level) {
+    if (level < 0 || level > 2) {
+        throw std::invalid_argument("Successive elimination level must be 0, 1 or 2");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _elimination_level = level;
+    ForgetReferences();
+}
+
+void MotionEstimator::setBorderExtension(bool extend) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _extend_borders = extend;
+    ForgetReferences();
+}
+
+void MotionEstimator::setLazyHalfpel(bool lazy) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _lazy_halfpel = lazy;
+    ForgetReferences();
+}
+
+void MotionEstimator::setVisitedCache(bool cache) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _visited_cache = cache;
+}
+
+void MotionEstimator::setEffortMap(bool effort_map) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _effort_map = effort_map;
+    this -> _effort.clear();
+}
+
+void MotionEstimator::setCrossSearchSide(int side) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _cross_search_side = side;
+}
+void MotionEstimator::setCrossSearchErrorThreshold(int threshold) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _cross_search_error_threshold = threshold;
+}
+void MotionEstimator::setSplitShare(int percent) {
+    if (percent < 0 || percent > 100) {
+        throw std::invalid_argument("Split share must be in [0, 100]");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _split_share = percent;
+}
+
+void MotionEstimator::setReferenceCount(int count) {
+    if (count < 1 || count > 8) {
+        throw std::invalid_argument("Reference count must be in [1, 8]");
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    // The nearest reference stays for Remap. A single one may have been
+    // read in place, so the ring starts over.
+    this -> _references.resize(1);
+    while (int(this -> _references.size()) < count) {
+        this -> _references.push_back(std::make_unique<ReferenceFrame>());
+    }
+    ForgetReferences();
 }
 
-void MotionEstimator::set_CrossSearch_Side(py::array_t<int> value) {
-    this -> _cross_search_side = *(int*)value.request().ptr;
+void MotionEstimator::setReferenceThreshold(int threshold) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _reference_threshold = threshold;
+}
+
+void MotionEstimator::setChangeDetection(bool detect) {
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _change_detection = detect;
+    this -> _changed.clear();
+}
+
+void MotionEstimator::setRegionOfInterest(const std::vector<uint8_t>& mask) {
+    if (!mask.empty() && mask.size() != size_t(_blocks_per_column) * _blocks_per_row) {
+        throw std::invalid_argument(
+            "Region of interest has to be " + std::to_string(_blocks_per_column) + "x" + std::to_string(_blocks_per_row) + " blocks"
+        );
+    }
+    std::lock_guard<std::mutex> lock(this -> _mutex);
+    this -> _region_of_interest = mask;
 }
-void MotionEstimator::set_CrossSearch_ErrorThreshold(py::array_t<int> value) {
-    this -> _cross_search_error_threshold = *(int*)value.request().ptr;
-}
\ No newline at end of file
@@ -1,38 +1,396 @@
 #pragma once
 
 #include <limits>
+#include <algorithm>
 #include <vector>
 #include <array>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include <stdexcept>
+#include <stddef.h>
 
 #include "matrix.h"
+#include "halfpel.h"
 #include "my_metric.h"
 #include "MotionVector.h"
+#include "motion_field.h"
+#include "frame_quality.h"
+#include "thread_pool.h"
 
-#include <pybind11/functional.h>
-#include <pybind11/stl.h> 
-#include <pybind11/pybind11.h>
-#include <pybind11/numpy.h>
+// Plane of height x width 8-bit samples whose rows start `stride` bytes
+// apart, how frames are handed to the native API
+struct FrameView {
+    const unsigned char* data;
+    int height;
+    int width;
+    ptrdiff_t stride;
+};
+
+// 4:2:0 frame: a luma plane of the frame size and two chroma planes of
+// (height + 1) / 2 x (width + 1) / 2 samples. Planar frames (I420) keep U
+// and V apart, NV12 interleaves them in one plane, so samples of one chroma
+// plane are chroma_step bytes apart. Pixel is const for input frames.
+template<typename Pixel>
+struct YuvView {
+    Pixel* y;
+    ptrdiff_t y_stride;
+    Pixel* u;
+    Pixel* v;
+    ptrdiff_t chroma_stride;
+    int chroma_step;
+
+    static YuvView Planar(Pixel* y, ptrdiff_t y_stride, Pixel* u, Pixel* v, ptrdiff_t chroma_stride) {
+        return {y, y_stride, u, v, chroma_stride, 1};
+    };
+    static YuvView NV12(Pixel* y, ptrdiff_t y_stride, Pixel* uv, ptrdiff_t uv_stride) {
+        return {y, y_stride, uv, uv + 1, uv_stride, 2};
+    };
+};
+typedef YuvView<const unsigned char> YuvFrameView;
+typedef YuvView<unsigned char> YuvOutputView;
+
+// Costs of the positions one search has already scored, in a fixed window
+// around the searched block. Every slot carries the number of the search
+// that wrote it, so starting a new search is O(1).
+class VisitedPositions {
+public:
+    static constexpr int _radius = 32;
+    static constexpr int _side = 2 * _radius + 1;
+
+    VisitedPositions() : _slots(_side * _side) {};
+
+    void Reset(int h, int w) {
+        this -> _origin_h = h;
+        this -> _origin_w = w;
+        if (++this -> _search == 0) {
+            // Wrapped around, old stamps could look current again
+            std::fill(_slots.begin(), _slots.end(), Slot());
+            this -> _search = 1;
+        }
+    };
+    // False if (h, w) was not scored yet or lies outside of the window
+    bool Find(int h, int w, int& cost) const {
+        int index = Index(h, w);
+        if (index < 0 || _slots[index].search != _search) {
+            return false;
+        }
+        cost = _slots[index].cost;
+        return true;
+    };
+    void Store(int h, int w, int cost) {
+        int index = Index(h, w);
+        if (index >= 0) {
+            _slots[index] = {_search, cost};
+        }
+    };
+private:
+    struct Slot {
+        uint32_t search = 0;
+        int cost = 0;
+    };
+    int Index(int h, int w) const {
+        h -= _origin_h - _radius;
+        w -= _origin_w - _radius;
+        if (unsigned(h) >= unsigned(_side) || unsigned(w) >= unsigned(_side)) {
+            return -1;
+        }
+        return h * _side + w;
+    };
+    int _origin_h = 0;
+    int _origin_w = 0;
+    uint32_t _search = 0;
+    std::vector<Slot> _slots;
+};
+
+// Counters of the searches, building with -DME_NO_STATS compiles them out
+#ifdef ME_NO_STATS
+constexpr bool stats_enabled = false;
+#else
+constexpr bool stats_enabled = true;
+#endif
+
+struct SearchStats {
+    // Positions scored by the kernels and positions taken from _visited
+    uint64_t evaluations = 0;
+    uint64_t reused = 0;
+    // Scored positions that came back as max(): cut off by the error bound,
+    // eliminated by their block sums or outside of the picture
+    uint64_t terminated = 0;
+    // Blocks settled by CheckIfStatic. GetCandidates hits are not counted,
+    // it only runs once is_first is cleared, which nothing does yet.
+    uint64_t static_hits = 0;
+    // Blocks split into quarters
+    uint64_t splits = 0;
+    // Blocks that were searched in the older references as well
+    uint64_t reference_searches = 0;
+    // Blocks the change detection found identical to the reference
+    uint64_t unchanged = 0;
+    // Most re-centring steps of one diamond or hexagon search
+    int max_depth = 0;
 
-namespace py = pybind11;
+    void Add(const SearchStats& other) {
+        this -> evaluations += other.evaluations;
+        this -> reused += other.reused;
+        this -> terminated += other.terminated;
+        this -> static_hits += other.static_hits;
+        this -> splits += other.splits;
+        this -> reference_searches += other.reference_searches;
+        this -> unchanged += other.unchanged;
+        this -> max_depth = std::max(this -> max_depth, other.max_depth);
+    };
+};
+
+// Mutable state of one search. Estimate keeps one per worker thread, so the
+// searches never write to the estimator itself.
+struct SearchContext {
+    // Starts the search of the block at (h, w) in one reference plane
+    void BeginSearch(int h, int w) {
+        this -> _iteration_count = 0;
+        this -> _visited.Reset(h, w);
+    };
+    void Count(uint64_t SearchStats::* counter, uint64_t count = 1) {
+        if constexpr (stats_enabled) {
+            this -> _stats.*counter += count;
+        }
+    };
+    // Called with _iteration_count after every re-centring step
+    void ReachDepth(int depth) {
+        if constexpr (stats_enabled) {
+            this -> _stats.max_depth = std::max(this -> _stats.max_depth, depth);
+        }
+    };
+
+    int _iteration_count = 0;
+    size_t _3DRS_offset_index = 0;
+    // Blocks of this size are not split any further
+    int _smallest_block = 0;
+    // Leaves of the block being estimated, see TrySplit. The best split over
+    // all reference planes so far is kept in _best_partition.
+    BlockPartition _partition;
+    BlockPartition _best_partition;
+    // Diamond and hexagon search re-centre on the best position, the
+    // positions they share with the previous step are taken from here
+    VisitedPositions _visited;
+    SearchStats _stats;
+};
+
+// Everything counted during one Estimate, the times are in milliseconds.
+// remap_ms belongs to the last Remap of that field.
+struct FrameStats {
+    SearchStats search;
+    double subpel_ms = 0;
+    double pyramid_ms = 0;
+    double search_ms = 0;
+    double remap_ms = 0;
+};
 
 class MotionEstimator {
+    // Reference planes of one frame, see _references
+    struct ReferenceFrame;
+    typedef std::vector<std::unique_ptr<ReferenceFrame>> ReferenceRing;
 public:
+    // Blocks of block_size pixels are split as a quad-tree down to
+    // min_block_size. Both are powers of two, 8 <= block_size <= 64 and
+    // 4 <= min_block_size <= block_size, std::invalid_argument otherwise.
     MotionEstimator(
         int width, 
         int height,
         int quality,
-        bool use_halfpixel
+        bool use_halfpixel,
+        int block_size = 16,
+        int min_block_size = 8
     );
     ~MotionEstimator();
 
-    void Estimate(
-        py::array_t<unsigned char> _previous_frame,
-        py::array_t<unsigned char> _current_frame
+    // Native API, safe to call from several threads, calls are serialised
+    // by the mutex of the estimator. Frames of any stride are accepted, they
+    // are copied only if the search can not read them in place.
+    //
+    // Returns the field of current_frame against previous_frame. Unless its
+    // stride is the width or several references are kept, the previous
+    // frame is read in place and has to stay alive until the next Estimate,
+    // Remap reads from it.
+    const MotionField& Estimate(FrameView previous_frame, FrameView current_frame);
+    // Motion-compensated reference of the last Estimate, written into a
+    // height x width plane whose rows are `stride` bytes apart
+    void Remap(unsigned char* out, ptrdiff_t stride);
+    // Remap plus the QualityMetrics of the result against the current frame,
+    // measured in the same pass
+    QualityMetrics Remap(unsigned char* out, ptrdiff_t stride, FrameView current_frame);
+    // Fields of every pair frames[i] -> frames[i + 1] of one stream, handed
+    // to store(pair, field) from the worker threads, see EstimateSequence
+    void EstimateBatch(
+        const std::vector<FrameView>& frames,
+        const std::function<void(int, const MotionField&)>& store
+    );
+    // Bidirectional estimation of current_frame. Returns the forward field
+    // against past_frame, like Estimate, and keeps the backward field
+    // against future_frame, see getBackwardField. The backward search of a
+    // block starts from its negated forward vector. past_frame is read in
+    // place like the previous frame of Estimate, future_frame is copied.
+    const MotionField& EstimateBidirectional(
+        FrameView past_frame,
+        FrameView current_frame,
+        FrameView future_frame
     );
+    // Bi-predicted frame of the last EstimateBidirectional, the rounded mean
+    // of the forward and the backward compensation
+    void RemapBidirectional(unsigned char* out, ptrdiff_t stride);
+    QualityMetrics RemapBidirectional(unsigned char* out, ptrdiff_t stride, FrameView current_frame);
+    // 4:2:0 frames are estimated on their luma planes alone. The chroma of
+    // the previous frame is copied for Remap, the luma plane is read in place
+    // like the previous frame of Estimate.
+    const MotionField& Estimate(const YuvFrameView& previous_frame, const YuvFrameView& current_frame);
+    // Compensates all three planes of `out`. Chroma blocks move by half the
+    // luma vector, interpolated bilinearly to a quarter sample. Throws
+    // std::invalid_argument unless the references came from YUV frames.
+    void Remap(const YuvOutputView& out);
+    // Throws std::invalid_argument unless `frame` is height x width
+    void CheckFrame(FrameView frame) const;
+    template<typename Pixel>
+    void CheckFrame(const YuvView<Pixel>& frame) const {
+        CheckFrame(FrameView{frame.y, _height, _width, frame.y_stride});
+        if (frame.chroma_step < 1 || frame.chroma_stride < ptrdiff_t(frame.chroma_step) * (getChromaWidth() - 1) + 1) {
+            throw std::invalid_argument("Chroma planes have to be " + std::to_string(getChromaHeight()) + "x" + std::to_string(getChromaWidth()));
+        }
+    };
+    // Unlocked entry points behind Estimate and Remap, for callers that
+    // hold getMutex(). The view version copies what Estimate would copy.
+    // The pointer version takes contiguous height x width luma planes, the
+    // current one padded to getPaddedFrameSize(), and the previous one has
+    // to stay alive until RemapFrame, which reads the reference planes built
+    // from it.
+    void EstimateFrame(FrameView previous_frame, FrameView current_frame);
+    void EstimateFrame(
+        unsigned char* previous_frame,
+        unsigned char* current_frame
+    );
+    void RemapFrame(unsigned char* result, ptrdiff_t stride);
+    QualityMetrics RemapFrame(unsigned char* result, ptrdiff_t stride, FrameView target);
+    void EstimateFrame(const YuvFrameView& previous_frame, const YuvFrameView& current_frame);
+    void RemapFrame(const YuvOutputView& result);
+    // Unlocked entry points behind EstimateBidirectional and
+    // RemapBidirectional. The pointer version takes padded frames like
+    // EstimateFrame, and the future one has to stay alive until
+    // RemapBidirectionalFrame as well.
+    void EstimateBidirectionalFrame(FrameView past_frame, FrameView current_frame, FrameView future_frame);
+    void EstimateBidirectionalFrame(
+        unsigned char* past_frame,
+        unsigned char* current_frame,
+        unsigned char* future_frame
+    );
+    void RemapBidirectionalFrame(unsigned char* result, ptrdiff_t stride);
+    QualityMetrics RemapBidirectionalFrame(unsigned char* result, ptrdiff_t stride, FrameView target);
+    void RemapFrame(unsigned char* result) {
+        RemapFrame(result, this -> _width);
+    };
+    QualityMetrics RemapFrame(unsigned char* result, const unsigned char* target) {
+        return RemapFrame(result, this -> _width, {target, _height, _width, _width});
+    };
+    // Unlocked part of EstimateBatch. The pairs are cut into one chunk per
+    // thread and every chunk runs on its own copy of the estimator, so the
+    // field of this estimator is not touched. store(pair, field) is called
+    // from the worker threads, in order within a chunk. A chunk only
+    // depends on the pairs before it through the older references, which it
+    // estimates again, since GetCandidates is off (is_first never clears).
+    // 3DRS streams are a single chunk whose frames are searched by all
+    // threads.
+    void EstimateSequence(
+        const std::vector<FrameView>& frames,
+        const std::function<void(int, const MotionField&)>& store
+    );
+    // Frames passed to EstimateFrame need getPaddedFrameSize() bytes, since
+    // blocks on the bottom edge are read whole. PadFrame fills the rows
+    // below the picture with copies of its last row.
+    size_t getPaddedFrameSize() const {
+        return size_t(_blocks_per_column * _block_size + 1) * _width;
+    };
+    void PadFrame(unsigned char* frame) const;
+    // Copies `frame` into a buffer of getPaddedFrameSize() bytes and pads it
+    void CopyFrame(FrameView frame, unsigned char* buffer) const;
+
+    int getWidth() const {
+        return this -> _width;
+    };
+    int getHeight() const {
+        return this -> _height;
+    };
+    int getBlockSize() const {
+        return this -> _block_size;
+    };
+    int getMinBlockSize() const {
+        return this -> _min_block_size;
+    };
+    int getBlocksPerRow() const {
+        return this -> _blocks_per_row;
+    };
+    int getBlocksPerColumn() const {
+        return this -> _blocks_per_column;
+    };
+    // Size of the chroma planes of 4:2:0 frames
+    int getChromaHeight() const {
+        return (this -> _height + 1) / 2;
+    };
+    int getChromaWidth() const {
+        return (this -> _width + 1) / 2;
+    };
+    // Native callers that drive the estimator through several calls, like
+    // EstimateFrame followed by RemapFrame, hold it for the whole sequence.
+    // Never wait for another lock, like the Python GIL, while holding it.
+    std::mutex& getMutex() const {
+        return this -> _mutex;
+    };
+    // Field of the last Estimate
+    const MotionField& getMotionField() const {
+        return this -> current_field;
+    };
+    // Backward field of the last EstimateBidirectional, its vectors point
+    // into the future frame and _reference is always 0
+    const MotionField& getBackwardField() const {
+        return this -> backward_field;
+    };
+    // Best vector over all reference planes for the block at (h, w), with
+    // the search method and the number of planes fixed at compile time
+    template<size_t mode, bool use_halfpixel>
+    MotionVector EstimateBlock(
+        SearchContext& context,
+        const Matrix& current_frame,
+        int h,
+        int w
+    );
+    typedef MotionVector (MotionEstimator::*BlockEstimator)(
+        SearchContext& context,
+        const Matrix& current_frame,
+        int h,
+        int w
+    );
+    // Specialisation of EstimateBlock for SEARCH_MODE and _use_halfpixel,
+    // looked up once per frame
+    BlockEstimator SelectBlockEstimator() const;
+    // Stores the result of EstimateBlock in current_field, the leaves of a
+    // split block are in the best partition of `context`
+    void StoreBlock(SearchContext& context, int row, int column, const MotionVector& motion_vector);
+    // Rotates the reference ring and builds the planes of the new nearest
+    // reference, see _references
+    void BuildReference(unsigned char* previous_frame, bool reuse_sums);
+    // Builds the planes of `reference` from `frame`, copied if `copy` or
+    // the borders are extended, otherwise read in place
+    void BuildPlanes(ReferenceFrame& reference, unsigned char* frame, bool copy, bool reuse_sums);
+    // Searches every block of current_frame against _references into
+    // current_field, on the thread pool if there is one
+    void SearchBlocks(const Matrix& current_frame);
+    // Fills _changed, see setChangeDetection
+    void DetectChanges(const Matrix& current_frame);
+    // Views of the frames EstimateFrame can read, copied if needed
+    std::pair<unsigned char*, unsigned char*> ReadableFrames(FrameView previous_frame, FrameView current_frame);
+    // Older references were built with other settings, they are not searched
+    void ForgetReferences();
 
     MotionVector FindBlock_BruteForce(
+        SearchContext& context,
         const Matrix& previous_frame, 
         const Matrix& current_frame,
         int dh,
@@ -40,7 +398,9 @@ public:
         int shifted_h,
         int shifted_w
     );
+    template<int block_size>
     MotionVector FindBlock_CrossSearch(
+        SearchContext& context,
         const Matrix& previous_frame, 
         const Matrix& current_frame,
         int dh,
@@ -48,10 +408,10 @@ public:
         size_t halfside, 
         int shifted_h,
         int shifted_w, 
-        int error,
-        int block_size
+        int error
     );
     MotionVector FindBlock_OrthonormalSearch(
+        SearchContext& context,
         const Matrix& previous_frame, 
         const Matrix& current_frame,
         int dh,
@@ -63,6 +423,7 @@ public:
         bool is_horizontal
     );
     MotionVector FindBlock_ThreeStepSearch(
+        SearchContext& context,
         const Matrix& previous_frame,
         const Matrix& current_frame,
         int dh,
@@ -73,6 +434,7 @@ public:
         int error
     );
     MotionVector FindBlock_3DRS(
+        SearchContext& context,
         const Matrix& previous_frame,
         const Matrix& current_frame,
         int dh,
@@ -81,7 +443,10 @@ public:
         int shifted_w,
         int error
     );
+    // Searches that split a block recurse into block_size / 2, see TrySplit
+    template<int block_size>
     MotionVector FindBlock_DiamondSearch(
+        SearchContext& context,
         const Matrix& previous_frame,
         const Matrix& current_frame,
         int dh,
@@ -89,24 +454,92 @@ public:
         int shifted_h,
         int shifted_w,
         int error,
-        int block_size,
         int shift_dir
     );
+    template<int block_size>
     MotionVector FindBlock_HexagonSearch(
+        SearchContext& context,
         const Matrix& previous_frame,
         const Matrix& current_frame,
         int dh,
         int dw,
         int shifted_h,
         int shifted_w,
-        int error, 
-        int block_size
+        int error
+    );
+    // Quad-tree step of the searches that split. `whole` is the best vector
+    // of the block at (dh, dw). Its quarters are searched only if the error
+    // reaches the split threshold of the size and the residual of `whole`
+    // is concentrated in one quarter, see setSplitShare. search_quarter(h,
+    // w, start_h, start_w) searches one quarter of block_size / 2 from the
+    // vector of the whole block. Returns the split, with its leaves in the
+    // partition of `context`, if the quarters are cheaper, otherwise `whole`.
+    template<int block_size, typename QuarterSearch>
+    MotionVector TrySplit(
+        SearchContext& context,
+        const Matrix& previous_frame,
+        const Matrix& current_frame,
+        int dh,
+        int dw,
+        const MotionVector& whole,
+        int threshold,
+        QuarterSearch&& search_quarter
     );
-    py::array_t<unsigned char> Remap(
-        py::array_t<unsigned char> _previous_frame
+    // Calls search.template operator()<size>() with size == block_size, so
+    // that runtime block sizes reach the templated searches
+    template<typename Search>
+    static MotionVector WithBlockSize(int block_size, Search&& search);
+    // Thresholds are given for 16x16 blocks. Split thresholds scale by
+    // area at every size, a quarter splits for the same error per pixel as
+    // its parent. Early-exit thresholds scale only for larger blocks, so the
+    // quarters of a split settle as early as the block would have.
+    int SplitThreshold(int threshold, int block_size) const {
+        if (threshold == std::numeric_limits<int>::max()) {
+            return threshold;
+        }
+        return int(std::min<int64_t>(int64_t(threshold) * block_size * block_size / 256, std::numeric_limits<int>::max()));
+    };
+    int ExitThreshold(int threshold, int block_size) const {
+        return SplitThreshold(threshold, std::max(block_size, 16));
+    };
+    // Compensates the blocks of one block row of `field`, whose vectors
+    // point into `references`
+    void RemapRow(
+        unsigned char* result,
+        ptrdiff_t stride,
+        int row,
+        const MotionField& field,
+        const ReferenceRing& references
     );
+    void RemapBidirectionalRow(unsigned char* result, ptrdiff_t stride, int row);
+    // Chroma of RemapRow, for both planes
+    void RemapChromaRow(
+        const YuvOutputView& result,
+        int row,
+        const MotionField& field,
+        const ReferenceRing& references
+    );
+    // Calls leaf(top, left, size, cell) for every leaf of the block row, with
+    // its top-left pixel, its size and its top-left cell in `field`
+    template<typename Leaf>
+    void ForEachLeaf(const MotionField& field, int row, Leaf&& leaf) const;
+    // Compensates the chroma of the leaf of `size` luma pixels at (top, left)
+    // in one plane. (dy, dx) is the luma vector in half pixels, which is a
+    // quarter of a chroma sample.
+    void AssignChromaBlock(
+        unsigned char* result,
+        ptrdiff_t stride,
+        int step,
+        const unsigned char* reference,
+        int top,
+        int left,
+        int size,
+        int dy,
+        int dx
+    ) const;
     void AssignBlock(
         unsigned char* result_ptr, 
+        ptrdiff_t stride,
         int dh, 
         int dw, 
         MotionVector& motion_vector, 
@@ -114,6 +547,18 @@ public:
         int block_size
     );
     int ComputeSum(const Matrix& frame, int h, int w);
+    // True if a lower bound computed from block sums alone shows that the
+    // squared difference reaches `error`
+    bool CanEliminate(
+        const Matrix& domain,
+        int domain_h,
+        int domain_w,
+        const Matrix& rank,
+        int rank_h,
+        int rank_w,
+        int block_size,
+        int error
+    ) const;
     int ComputeAbsDifference(
         const Matrix& domain, 
         int domain_h,
@@ -121,10 +566,54 @@ public:
         const Matrix& rank,
         int rank_h,
         int rank_w,
-        int block_size = 16, 
+        int block_size,
         int error = std::numeric_limits<int>::max()
     );
+    // Scores `count` candidates at domain_h/domain_w + offsets[i] against one
+    // rank block in a single pass, out-of-picture candidates cost max()
+    void ComputeAbsDifferenceBatch(
+        const Matrix& domain,
+        int domain_h,
+        int domain_w,
+        const std::pair<int, int>* offsets,
+        int count,
+        const Matrix& rank,
+        int rank_h,
+        int rank_w,
+        int block_size,
+        int error,
+        int* costs
+    );
+    // ComputeAbsDifference for the searches, counted in the stats of `context`
+    int ScoreCandidate(
+        SearchContext& context,
+        const Matrix& domain,
+        int domain_h,
+        int domain_w,
+        const Matrix& rank,
+        int rank_h,
+        int rank_w,
+        int block_size,
+        int error = std::numeric_limits<int>::max()
+    );
+    // ComputeAbsDifferenceBatch for the iterative searches, positions the
+    // current search of `context` already scored are not scored again
+    void ScoreCandidates(
+        SearchContext& context,
+        const Matrix& domain,
+        int domain_h,
+        int domain_w,
+        const std::pair<int, int>* offsets,
+        int count,
+        const Matrix& rank,
+        int rank_h,
+        int rank_w,
+        int block_size,
+        int error,
+        int* costs
+    );
     MotionVector CheckIfStatic(
+        SearchContext& context,
         const Matrix& previous_frame,
         const Matrix& current_frame,
         int dh,
@@ -137,6 +626,7 @@ public:
     int clip(int pos, int total);
     
     MotionVector GetCandidates(
+        SearchContext& context,
         const Matrix& preivous_frame,
         const Matrix& current_frame,
         int dh,
@@ -154,11 +644,75 @@ public:
         int height,
         int width
     );
+    // Halves both dimensions, every output pixel is the rounded mean of a 2x2 square
+    void Downsample(
+        const unsigned char* input,
+        unsigned char* output,
+        int height,
+        int width
+    );
+    // Coarse-to-fine search over the pyramid levels above the full-resolution
+    // frame, fills _seeds with full-resolution offsets
+    void EstimatePyramid(
+        const unsigned char* previous_frame,
+        const unsigned char* current_frame,
+        bool reuse_previous
+    );
+    // Fast 64-bit hash of a whole height x width frame
+    uint64_t HashFrame(const unsigned char* frame) const;
     int GetKey(int h, int w) const;
-    // python setters
-    void set_SearchMethod(py::array_t<int> value);
-    void set_CrossSearch_Side(py::array_t<int> value);
-    void set_CrossSearch_ErrorThreshold(py::array_t<int> value);
+    // New estimator with the same settings and a single thread
+    std::unique_ptr<MotionEstimator> CloneSettings() const;
+    // Positions scored by the kernels and positions reused by the iterative
+    // searches during the last Estimate
+    std::pair<uint64_t, uint64_t> get_EvaluationCount() const;
+    // Counters and phase times of the last Estimate, all zero when built
+    // with ME_NO_STATS. Read under getMutex().
+    const FrameStats& getFrameStats() const {
+        return this -> _frame_stats;
+    };
+    // Evaluations per block of the last Estimate, row-major over the block
+    // grid. Empty unless the effort map is on. Read under getMutex().
+    const std::vector<uint32_t>& getEffortMap() const {
+        return this -> _effort;
+    };
+    // Settings, every setter takes the mutex. Invalid values throw
+    // std::invalid_argument.
+    void setSearchMethod(int mode);
+    // 0 or less picks one thread per core
+    void setThreadCount(int thread_count);
+    void setPyramidLevels(int levels);
+    void setSuccessiveElimination(int level);
+    void setBorderExtension(bool extend);
+    void setLazyHalfpel(bool lazy);
+    // The diamond, hexagon and three-step searches look up positions they
+    // already scored for the block instead of scoring them again. On by
+    // default, turning it off only costs time, the fields are the same.
+    void setVisitedCache(bool cache);
+    void setEffortMap(bool effort_map);
+    void setCrossSearchSide(int side);
+    // Share of the error, in percent, the worst quarter of a block has to
+    // hold for the quarters to be searched. An even residual is noise or
+    // a brightness change that smaller blocks do not fix. 0 searches the
+    // quarters of every block above the split threshold.
+    void setSplitShare(int percent);
+    void setCrossSearchErrorThreshold(int threshold);
+    // Multi-reference search over the previous frames of the last `count`
+    // Estimate calls, 1 <= count <= 8. Frames are expected in stream order,
+    // like EstimateBatch passes them. The older references are searched
+    // for blocks whose error in the nearest one is at least `threshold` per
+    // 16x16 pixels, 40'000 by default.
+    void setReferenceCount(int count);
+    void setReferenceThreshold(int threshold);
+    // Compares every block with the co-located block of the nearest
+    // reference before the search. Identical blocks are not searched, they
+    // get the zero vector with error 0, the exact match.
+    void setChangeDetection(bool detect);
+    // Only blocks whose entry of `mask`, row-major over the block grid, is
+    // not zero are estimated. The others keep the co-located block with an
+    // error of max(), like blocks nothing in the reference matches. An
+    // empty mask estimates every block.
+    void setRegionOfInterest(const std::vector<uint8_t>& mask);
 private:
     enum MODE {
         BruteForce = 0,
@@ -169,17 +723,39 @@ private:
         DiamondSearch,
         HexagonSearch
     };
-    std::vector<MotionVector> previous_storage;
-    std::vector<MotionVector> current_storage;
+    mutable std::mutex _mutex;
+    // Frames the search can not read in place are copied here. The current
+    // frame when it does not fill whole blocks or is strided, the previous
+    // one when it is strided. Estimate swaps the two before it copies the
+    // previous frame, so a copied frame keeps its address when it comes
+    // back as the reference and its derived planes are still reused.
+    std::vector<unsigned char> _current_copy;
+    std::vector<unsigned char> _reference_copy;
 
-    std::vector<int> previous_frame_precomputed, current_frame_precomputed;
+    // Preallocated once, Estimate copies the current field into the previous
+    // one, so that the numpy views of current_field stay valid
+    MotionField previous_field;
+    MotionField current_field;
+    // Same for the backward fields of EstimateBidirectional
+    MotionField previous_backward_field;
+    MotionField backward_field;
+
+    // Successive elimination: 0 - off, 1 - SEA on whole-block sums,
+    // 2 - MSEA on quadrant sums plus the bound from the sums of squares.
+    // One table per reference plane, see ReferenceFrame.
+    int _elimination_level;
+    IntegralImage current_frame_precomputed;
     // Global params
     const int _width;
     const int _height;
     const int _quality;
     const bool _use_halfpixel;
 
-    static constexpr int _block_size = 16;
+    const int _block_size;
+    const int _min_block_size;
+    int _split_share;
+    // Largest candidate pattern passed to ComputeAbsDifferenceBatch
+    static constexpr int _max_batch_size = 16;
 
     size_t SEARCH_MODE;
 
@@ -187,15 +763,53 @@ private:
     int _error_threshold;
     int _stop_threshold;
     int candidate_threshold;
+
+    // Block grid, the last row/column may be cut by the frame border
+    const int _blocks_per_row;
+    const int _blocks_per_column;
     
-    // _use_halfpixel == true
-    std::vector<Matrix> frames;
-    unsigned char* previous_up;
-    unsigned char* previous_up_left;
-    unsigned char* previous_left;
-
-    // If we extend borders, we need this
-    unsigned char* previous_extended;
+    // One reference frame and everything derived from it
+    struct ReferenceFrame {
+        // Copy of the frame, padded if the borders are extended. A single
+        // unpadded reference is read in place instead.
+        std::vector<unsigned char> pixels;
+        // Half-pixel planes, sized for the padded frame
+        std::vector<unsigned char> up;
+        std::vector<unsigned char> left;
+        std::vector<unsigned char> up_left;
+        HalfpelTiles tiles;
+        std::vector<IntegralImage> sums;
+        // Full-pixel plane, then the half-pixel planes, indexed by shift_dir
+        std::vector<Matrix> planes;
+        // Planar copies of the chroma, only if the frame came as 4:2:0
+        bool has_chroma = false;
+        std::vector<unsigned char> u;
+        std::vector<unsigned char> v;
+    };
+    // Ring of references, [0] is the previous frame of the last Estimate
+    // and [i] the one of i calls before. Every Estimate rotates the ring by
+    // one and builds the new reference into the slot of the oldest, so the
+    // planes of a frame are built once. Only the first _references_filled
+    // slots hold frames of the current stream.
+    ReferenceRing _references;
+    int _references_filled;
+    int _reference_threshold;
+    // Single reference of the backward search, swapped with _references
+    // while it runs. The future frame is copied into _future_copy, and the
+    // backward compensation goes to _backward_prediction before averaging.
+    ReferenceRing _future_references;
+    int _future_filled;
+    std::vector<unsigned char> _future_copy;
+    std::vector<unsigned char> _backward_prediction;
+    // Lazy mode: the planes are interpolated tile by tile while searching
+    bool _lazy_halfpel;
+    // See setVisitedCache
+    bool _visited_cache;
+
+    // If we extend borders, the reference planes are padded by border_size
+    // replicated pixels, so vectors may point outside of the picture and
+    // Remap can still read them.
+    bool _extend_borders;
     int border_size;
     int new_width;
     int new_height;
@@ -220,13 +834,6 @@ private:
     int _three_step_search_side;
 
     // Diamond-search params
-    // This map maps pair of  coordinates ([h, w], [h', w']) -> error.
-    // How can we make sure, that the key is unique for some value (h_1, w_1)?
-    // Well, it can be just flatten coordinate of given element (h_1 * this -> _width + w_1)
-    // This value has to be unique because we have [0, _height *_width) elements in the matrix
-    int _iteration_count;
-    std::map<std::pair<int, int>, int> _diamond_search_error_map;
-    std::map<std::pair<int, int>, int> _diamon_search_error_map_old;
     std::array<std::pair<int, int>, 4> small_diamond;
     std::array<std::pair<int, int>, 9> large_diamond;
 
@@ -234,47 +841,72 @@ private:
     std::array<std::pair<int, int>, 9> large_diamond_shifted;
     
 
-    // 3DRS params
-    static constexpr std::array<std::pair<int, int>, 2> _3DRS_current_frame_offset{
-        {{-_block_size, -_block_size}, {-_block_size, _block_size}}
+    // 3DRS params. Spatial neighbours in blocks, estimated before the block
+    // in the current field: upper-left, upper-right and left
+    static constexpr std::array<std::pair<int, int>, 3> _3DRS_current_frame_offset{
+        {{-1, -1}, {-1, 1}, {0, -1}}
     };
+    // Temporal neighbours in blocks, the co-located block and the ones the
+    // current field has not reached yet
     static constexpr std::array<std::pair<int, int>, 4> _3DRS_previous_frame_offset{
-        {{2 * _block_size, 2 * _block_size}, {2 * _block_size, 2 * _block_size},
-         {_block_size, -_block_size},         {_block_size, _block_size}}
-    };
-    static constexpr std::array<std::pair<int, int>, 9> _3DRS_random_fluctuations{
-        {{0, 0}, 
-         {0, _block_size}, {_block_size, 0}, 
-         {0, -_block_size}, {-_block_size, 0},
-         {0, 3 * _block_size}, {0, - 3 * _block_size},
-         {2 * _block_size, -2 * _block_size}}
-    };
-    static const size_t _3DRS_random_fluct_size = 9;
-    size_t _3DRS_offset_index;
-};
+        {{0, 0}, {0, 1},
+         {1, -1}, {1, 1}}
+    };
+    // Update vectors in pixels, added to the spatial candidates in turn
+    static constexpr std::array<std::pair<int, int>, 8> _3DRS_random_fluctuations{
+        {{0, 1}, {1, 0},
+         {0, -1}, {-1, 0},
+         {0, 3}, {0, -3},
+         {2, 0}, {-2, 0}}
+    };
+    // Zero vector, start and the neighbours, so every block costs at most
+    // this many evaluations per reference plane
+    static constexpr int _3DRS_candidate_count = 2 + 2 * _3DRS_current_frame_offset.size() + _3DRS_previous_frame_offset.size();
+    static_assert(_3DRS_candidate_count <= _max_batch_size);
 
-// motion_vector = GetCandidates(frames[shift_dir], current_frame, h, w);
-// motion_vector.shift_dir = shift_dir;
-// if (motion_vector._error < this -> candidate_threshold) {
-//     found_motion_vector = motion_vector;
-//     if (motion_vector.getHeight() != h && motion_vector.getWidth() != w) {
-//         std::cout << "w : " << w << " h : " << h << " motion_vector.getHeight() " << motion_vector.getHeight() << " motion_vector.getWidth() " << motion_vector.getWidth() << std::endl;
-//         std::cout << "Found candidate, on " + std::to_string(h) + " " + std::to_string(w) << std::endl;
-//         break;
-//     }
-// }
-// if (this -> SEARCH_MODE == MODE::BruteForce) {
-//     motion_vector = this -> FindBlock_BruteForce(frames[shift_dir], current_frame, h, w, h, w);
-// } else if (this -> SEARCH_MODE == MODE::CrossSearch) {
-//     motion_vector = this -> FindBlock_CrossSearch(frames[shift_dir], current_frame, h, w, this -> _cross_search_side, h, w, std::numeric_limits<int>::max(), this -> _block_size);
-// } else if (this -> SEARCH_MODE == MODE::OrthonormalSearch) {
-//     motion_vector = this -> FindBlock_OrthonormalSearch(frames[shift_dir], current_frame, h, w, this -> _orthonormal_search_step_size, h, w, std::numeric_limits<int>::max(), true);
-// } else if (this -> SEARCH_MODE == MODE::_3DRS) {
-//     motion_vector = this -> FindBlock_3DRS(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max());
-// } else if (this -> SEARCH_MODE == MODE::ThreeStepSearch) {
-//     motion_vector = this -> FindBlock_ThreeStepSearch(frames[shift_dir], current_frame, h, w, this -> _three_step_search_side, h, w, std::numeric_limits<int>::max());
-// } else if (this -> SEARCH_MODE == MODE::DiamondSearch) {
-//     motion_vector = this -> FindBlock_DiamondSearch(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max(), this -> _block_size);
-// } else if(this -> SEARCH_MODE == MODE::HexagonSearch) {
-//     motion_vector = this -> FindBlock_HexagonSearch(frames[shift_dir], current_frame, h, w, h, w, std::numeric_limits<int>::max(), this -> _block_size);
-// }
\ No newline at end of file
+    // Hierarchical search. Level l is downsampled 2^l times and searched with
+    // blocks of _block_size >> l, so every level has the same block grid and a
+    // vector found on level l doubles as the start of level l - 1.
+    int _pyramid_levels;
+    // Nothing seeds the coarsest level, so it is searched exhaustively within
+    // this many of its pixels, 4 << (levels - 1) times as many at full size
+    static constexpr int _pyramid_search_range = 4;
+    std::vector<std::vector<unsigned char>> _previous_pyramid;
+    std::vector<std::vector<unsigned char>> _current_pyramid;
+    // Start offsets of the blocks while _seeded, from the pyramid or the
+    // negated forward vectors of EstimateBidirectional
+    std::vector<std::pair<int, int>> _seeds;
+    bool _seeded;
+
+    // Streams pass every frame twice, first as the current frame and then as
+    // the reference. What was derived from the current frame is kept and
+    // reused if the next reference is the same buffer with the same content.
+    struct DerivedFrameCache {
+        const unsigned char* frame = nullptr;
+        uint64_t hash = 0;
+        // Levels held by _current_pyramid, 1 if it was not built
+        int pyramid_levels = 1;
+        // Level current_frame_precomputed was built for, 0 if it was not
+        int elimination_level = 0;
+    };
+    DerivedFrameCache _derived_cache;
+
+    // Wavefront parallelism: block rows are handed out to the pool in order,
+    // a block starts once its upper-right neighbour is done, because
+    // GetCandidates reads the row above from current_field.
+    size_t _thread_count;
+    std::unique_ptr<ThreadPool> _thread_pool;
+    std::vector<SearchContext> _contexts;
+
+    FrameStats _frame_stats;
+    // Evaluations per block of the last Estimate, only kept if it is on
+    bool _effort_map;
+    std::vector<uint32_t> _effort;
+    // One flag per block of the frame being searched, set if any pixel
+    // differs from the nearest reference. Empty unless the detection is on.
+    bool _change_detection;
+    std::vector<uint8_t> _changed;
+    // Blocks to estimate, empty for all of them
+    std::vector<uint8_t> _region_of_interest;
+    std::unique_ptr<std::atomic<int>[]> _row_progress;
+};
@@ -1,4 +1,5 @@
 import pytest
+from concurrent.futures import ThreadPoolExecutor
 import me_estimator
 import cv2
 from skimage.measure import compare_ssim, compare_psnr
@@ -68,3 +69,427 @@ def test_equal_remap():
     print(compare_ssim(compensated_frame_reference, compensated_frame))
     print(np.abs(compensated_frame - compensated_frame_reference).mean())
     assert np.abs(compensated_frame - compensated_frame_reference).mean() < 1
+
+
+def test_border_extension():
+    frame = cv2.imread('images/kiki.png', 0)
+    # Moves down by one row, the top row is replicated like the padded border
+    shifted_frame = np.empty(frame.shape, np.uint8)
+    shifted_frame[1:, :] = frame[:-1, :]
+    shifted_frame[0, :] = frame[0, :]
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    me.set_BorderExtension(np.array([1], dtype=np.int32))
+    me.Estimate(frame, shifted_frame)
+    compensated_frame = me.Remap(frame)
+    # Blocks of the first row point one row above the picture and still match
+    assert np.abs(shifted_frame[:16, :].astype(np.int32) - compensated_frame[:16, :]).mean() < 1
+
+
+@pytest.mark.parametrize('block_size', [4, 8, 16, 32])
+def test_distortion_kernels(block_size):
+    random = np.random.RandomState(block_size)
+    domain = random.randint(0, 256, (64, 80)).astype(np.uint8)
+    offsets = [(0, 0)] + [(random.randint(0, 64 - block_size + 1), random.randint(0, 80 - block_size + 1)) for _ in range(15)]
+    # A rank block that nearly matches the first domain block and an unrelated one
+    ranks = [np.clip(domain[:block_size, :block_size] + random.randint(0, 4, (block_size, block_size)), 0, 255).astype(np.uint8),
+             random.randint(0, 256, (block_size, block_size)).astype(np.uint8)]
+
+    def costs():
+        result = []
+        for rank in ranks:
+            for h, w in offsets:
+                full = me_estimator.block_ssd(domain, h, w, rank, block_size)
+                # Early termination has to agree as well
+                result += [full, me_estimator.block_ssd(domain, h, w, rank, block_size, full // 2 + 1),
+                           me_estimator.block_sad(domain, h, w, rank, block_size),
+                           me_estimator.block_sad(domain, h, w, rank, block_size, 100)]
+            result += me_estimator.block_ssd_batch(domain, offsets, rank, block_size)
+            result += me_estimator.block_ssd_batch(domain, offsets, rank, block_size, result[0] + 1)
+        return result
+
+    try:
+        me_estimator.select_distortion_kernels(0)
+        expected = costs()
+        for level in (1, 2, 3):
+            me_estimator.select_distortion_kernels(level)
+            assert costs() == expected
+    finally:
+        me_estimator.select_distortion_kernels(me_estimator.detect_simd_level())
+
+
+@pytest.mark.parametrize('method', range(7))
+def test_search_methods(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    me.set_SearchMethod(np.array([method], dtype=np.int32))
+    me.Estimate(frame, frame)
+    assert np.abs(frame.astype(np.int32) - me.Remap(frame)).sum() == 0
+
+
+@pytest.mark.parametrize('method', [0, 5])
+def test_successive_elimination(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    current = np.roll(frame, (2, 5), axis=(0, 1))
+    current[100:160, 200:280] = frame[90:150, 190:270]
+    fields = []
+    for level in range(3):
+        me = me_estimator.MotionEstimator(448, 240, 100, True)
+        me.set_SearchMethod(np.array([method], dtype=np.int32))
+        me.set_SuccessiveElimination(np.array([level], dtype=np.int32))
+        fields.append({key: value.copy() for key, value in me.Estimate(frame, current).items()})
+    # Only candidates that cannot win are skipped
+    for field in fields[1:]:
+        for key in fields[0]:
+            assert (field[key] == fields[0][key]).all(), key
+
+
+@pytest.mark.parametrize('method', [5, 6])
+def test_visited_cache(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    current = np.roll(frame, (2, 5), axis=(0, 1))
+    current[100:160, 200:280] = frame[90:150, 190:270]
+    fields, counts = [], []
+    for cache in range(2):
+        me = me_estimator.MotionEstimator(448, 240, 100, True)
+        me.set_SearchMethod(np.array([method], dtype=np.int32))
+        me.set_VisitedCache(np.array([cache], dtype=np.int32))
+        fields.append({key: value.copy() for key, value in me.Estimate(frame, current).items()})
+        counts.append(me.get_EvaluationCount())
+    for key in fields[0]:
+        assert (fields[1][key] == fields[0][key]).all(), key
+    # Every position the cache answers is one the kernels scored without it
+    assert counts[0][1] == 0 and counts[1][1] > 0
+    assert counts[1][0] + counts[1][1] == counts[0][0]
+
+
+def test_3drs():
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    me.set_SearchMethod(np.array([3], dtype=np.int32))
+    # The vectors of the previous field and of the neighbours carry the
+    # motion, whatever its length
+    for shift in range(1, 4):
+        field = me.Estimate(np.roll(frame, 6 * (shift - 1), axis=1), np.roll(frame, 6 * shift, axis=1))
+    assert np.median(field['dx'][4:-4, 4:-4]) == -6
+    assert me.GetStats()['evaluations'] <= 12 * 15 * 28
+
+
+def test_pyramid():
+    frame = cv2.imread('images/kiki.png', 0)
+    shifted = np.roll(frame, (8, 12), axis=(0, 1))
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    me.set_PyramidLevels(np.array([3], dtype=np.int32))
+    field = me.Estimate(frame, shifted)
+    # Away from the wrapped border every block follows the pan
+    assert np.median(field['dy'][3:-3, 3:-3]) == -8
+    assert np.median(field['dx'][3:-3, 3:-3]) == -12
+    for levels in (0, 4):
+        with pytest.raises(ValueError):
+            me.set_PyramidLevels(np.array([levels], dtype=np.int32))
+    # 8x8 blocks would be searched as 2x2 blocks on the third level
+    small = me_estimator.MotionEstimator(448, 240, 100, False, block_size=8, min_block_size=4)
+    with pytest.raises(ValueError):
+        small.set_PyramidLevels(np.array([3], dtype=np.int32))
+
+
+def test_motion_field_views():
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    field = me.Estimate(np.roll(frame, 1, axis=0), frame)
+    assert field['dy'].shape == (30, 56) and field['split'].shape == (15, 28)
+    assert np.median(field['dy'][4:-4, 4:-4]) == 1
+    # The views are not copies, the next Estimate shows through them
+    me.Estimate(frame, frame)
+    assert np.abs(field['dy']).sum() == 0
+
+
+def test_lazy_halfpel():
+    frame = cv2.imread('images/kiki.png', 0)
+    shifted_frame = np.roll(frame, 3, axis=1)
+    fields = []
+    for lazy in range(2):
+        me = me_estimator.MotionEstimator(448, 240, 100, True)
+        me.set_LazyHalfpel(np.array([lazy], dtype=np.int32))
+        field = me.Estimate(frame, shifted_frame)
+        fields.append((field['dy'].copy(), field['dx'].copy(), field['phase'].copy(), me.Remap(frame)))
+    # Interpolating on demand gives the same planes as the whole-frame pass
+    for eager, lazy in zip(*fields):
+        assert (eager == lazy).all()
+
+
+def test_derived_frame_reuse():
+    frame = cv2.imread('images/kiki.png', 0)
+    frames = [np.ascontiguousarray(np.roll(frame, shift, axis=1)) for shift in range(3)]
+
+    def estimator():
+        me = me_estimator.MotionEstimator(448, 240, 100, False)
+        me.set_PyramidLevels(np.array([2], dtype=np.int32))
+        me.set_SuccessiveElimination(np.array([2], dtype=np.int32))
+        return me
+
+    me = estimator()
+    buffer = frames[1].copy()
+    me.Estimate(frames[0], buffer)
+    # The same buffer comes back as the reference, but with other content
+    buffer[:] = frames[2]
+    field = me.Estimate(buffer, frames[1])
+    reference = estimator().Estimate(frames[2], frames[1])
+    assert (field['dy'] == reference['dy']).all() and (field['dx'] == reference['dx']).all()
+
+
+def test_estimators_in_threads():
+    frame = cv2.imread('images/kiki.png', 0)
+    pairs = [(frame, np.roll(frame, shift, axis=0)) for shift in range(4)]
+
+    def estimate(pair):
+        me = me_estimator.MotionEstimator(448, 240, 100, True)
+        me.Estimate(*pair)
+        return me.Remap(pair[0])
+
+    # One estimator per thread, the GIL is released while they estimate
+    with ThreadPoolExecutor(4) as pool:
+        results = list(pool.map(estimate, pairs))
+    for pair, result in zip(pairs, results):
+        assert (result == estimate(pair)).all()
+
+
+@pytest.mark.parametrize('method', [3, 5, 6])
+def test_wavefront_matches_serial(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    moving = [np.roll(frame, shift, axis=1) for shift in range(0, 12, 3)]
+    for image in moving:
+        image[100:160, 200:280] = frame[90:150, 190:270]
+    fields = []
+    for threads in (1, 4):
+        me = me_estimator.MotionEstimator(448, 240, 100, True)
+        me.set_SearchMethod(np.array([method], dtype=np.int32))
+        me.set_ThreadCount(np.array([threads], dtype=np.int32))
+        fields.append([{key: value.copy() for key, value in me.Estimate(previous, current).items()}
+                       for previous, current in zip(moving, moving[1:])])
+    # Rows run concurrently, yet every block sees the same neighbours
+    for serial, parallel in zip(*fields):
+        for key in serial:
+            assert (serial[key] == parallel[key]).all(), key
+
+
+@pytest.mark.parametrize('method', [5, 3])
+def test_estimate_batch(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    frames = np.stack([np.roll(frame, shift, axis=0) for shift in range(6)])
+    # A patch moving against the background, 3DRS carries its vectors from
+    # field to field
+    for shift in range(6):
+        frames[shift, 100:160, 200:280] = frame[90:150, 190 - shift:270 - shift]
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    me.set_SearchMethod(np.array([method], dtype=np.int32))
+    me.set_ThreadCount(np.array([3], dtype=np.int32))
+    fields = me.EstimateBatch(frames)
+    assert fields['dy'].shape == (5, 30, 56) and fields['split'].shape == (5, 15, 28)
+    # Every chunk gives the same fields as estimating the pairs one by one
+    single = me_estimator.MotionEstimator(448, 240, 100, False)
+    single.set_SearchMethod(np.array([method], dtype=np.int32))
+    for pair in range(5):
+        field = single.Estimate(frames[pair], frames[pair + 1])
+        assert (fields['dy'][pair] == field['dy']).all() and (fields['cost'][pair] == field['cost']).all()
+
+
+def test_quad_tree():
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, False, block_size=32, min_block_size=4)
+    field = me.Estimate(frame, frame)
+    # The last block row is cut by the frame border
+    assert field['dy'].shape == (64, 112) and field['split'].shape == (8, 14)
+    assert (me.Remap(frame) == frame).all()
+    # Leaves are never smaller than min_block_size
+    field = me.Estimate(frame, np.roll(frame, 5, axis=0))
+    assert field['depth'].max() <= 3
+    with pytest.raises(ValueError):
+        me_estimator.MotionEstimator(448, 240, 100, False, block_size=16, min_block_size=32)
+
+
+def test_multiple_references():
+    frame = cv2.imread('images/kiki.png', 0)
+    flash = (frame // 2 + 128).astype(np.uint8)
+    clip = [frame, np.roll(frame, 1, axis=1), flash, np.roll(frame, 2, axis=1)]
+    errors = []
+    for count in (1, 2):
+        me = me_estimator.MotionEstimator(448, 240, 100, False)
+        me.set_ReferenceCount(np.array([count], dtype=np.int32))
+        for previous, current in zip(clip, clip[1:]):
+            field = me.Estimate(previous, current)
+        errors.append(np.abs(me.Remap(flash).astype(np.int32) - clip[3]).mean())
+    # After the flash most blocks come from the frame before it
+    assert (field['reference'] == 1).mean() > 0.5
+    assert errors[1] < errors[0] / 2
+
+
+def test_bidirectional():
+    frame = cv2.imread('images/kiki.png', 0)
+    noise = np.random.RandomState(0)
+    clip = [np.clip(np.roll(frame, 2 * i, axis=1) + noise.normal(0, 6, frame.shape), 0, 255).astype(np.uint8) for i in range(3)]
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    fields = me.EstimateBidirectional(*clip)
+    assert np.median(fields['forward']['dx']) == -2
+    assert np.median(fields['backward']['dx']) == 2
+    _, forward = me.RemapWithMetrics(clip[0], clip[1])
+    _, bidirectional = me.RemapBidirectionalWithMetrics(clip[1])
+    # Averaging the two predictions cancels part of their noise
+    assert bidirectional.psnr > forward.psnr + 0.5
+    # Plain Estimate still works on the forward references
+    me.Estimate(clip[1], clip[2])
+    assert np.median(me.GetMotionField()['dx']) == -2
+
+
+def test_seeds_large_blocks():
+    frame = cv2.imread('images/kiki.png', 0)
+    clip = [np.roll(frame, (8 * i, 12 * i), axis=(0, 1)) for i in range(3)]
+    me = me_estimator.MotionEstimator(448, 240, 100, False, block_size=32)
+    me.set_PyramidLevels(np.array([2], dtype=np.int32))
+    fields = me.EstimateBidirectional(*clip)
+    # Pyramid and backward seeds are checked against the zero vector over
+    # the whole 32x32 block, not over its first 16x16 quarter
+    for name, sign in (('forward', -1), ('backward', 1)):
+        dy, dx = fields[name]['dy'][4:-6, 4:-4], fields[name]['dx'][4:-6, 4:-4]
+        assert ((dy == 8 * sign) & (dx == 12 * sign)).mean() > 0.9, name
+
+
+def test_yuv():
+    image = cv2.imread('images/kiki.png')
+    frames = [cv2.cvtColor(np.roll(image, shift, axis=1), cv2.COLOR_BGR2YUV_I420) for shift in (0, 4)]
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    me.EstimateYuv(frames[0], frames[1])
+    compensated = me.RemapYuv()
+    assert compensated.shape == (360, 448)
+    # Chroma moves with the luma, without any conversion in Python
+    chroma = slice(240, 360), slice(8, -8)
+    error = np.abs(compensated[chroma].astype(np.int32) - frames[1][chroma]).mean()
+    assert error < np.abs(frames[0][chroma].astype(np.int32) - frames[1][chroma]).mean() / 4
+
+    def to_nv12(frame):
+        u = frame[240:300].reshape(120, 224)
+        v = frame[300:].reshape(120, 224)
+        return np.vstack([frame[:240], np.dstack([u, v]).reshape(120, 448)])
+    me.EstimateYuv(to_nv12(frames[0]), to_nv12(frames[1]), 'NV12')
+    assert (me.RemapYuv() == to_nv12(compensated)).all()
+    with pytest.raises(ValueError):
+        me.EstimateYuv(frames[0], frames[1], 'YUY2')
+
+
+def test_change_detection():
+    frame = cv2.imread('images/kiki.png', 0)
+    moved = frame.copy()
+    moved[64:128, 64:128] = frame[64:128, 61:125]
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    field = me.Estimate(frame, moved)
+    expected = {key: value.copy() for key, value in field.items()}
+    me.set_ChangeDetection(np.array([1]))
+    field = me.Estimate(frame, moved)
+    # Only the blocks around the moved square are searched
+    assert me.GetStats()['unchanged'] >= 15 * 28 - 6 * 6
+    assert (field['dx'][8:16, 8:16] == expected['dx'][8:16, 8:16]).all()
+    compensated = me.Remap(frame)
+    outside = np.ones(frame.shape, bool)
+    outside[48:144, 48:144] = False
+    assert (compensated[outside] == moved[outside]).all()
+
+
+def test_region_of_interest():
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, False)
+    mask = np.zeros((15, 28), np.uint8)
+    mask[4:8, 10:20] = 1
+    me.set_RegionOfInterest(mask)
+    field = me.Estimate(frame, np.roll(frame, 2, axis=1))
+    inside = field['dx'].reshape(15, 2, 28, 2)[4:8, :, 10:20]
+    assert (inside == -2).all()
+    assert (field['cost'].reshape(15, 2, 28, 2).transpose(0, 2, 1, 3)[mask == 0] == np.iinfo(np.int32).max).all()
+    with pytest.raises(ValueError):
+        me.set_RegionOfInterest(np.ones((14, 28), np.uint8))
+    me.set_RegionOfInterest(None)
+    field = me.Estimate(frame, np.roll(frame, 2, axis=1))
+    assert np.median(field['dx']) == -2
+
+
+def test_remap_out():
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    me.Estimate(frame, np.roll(frame, 2, axis=1))
+    out = np.empty_like(frame)
+    result = me.Remap(frame, out=out)
+    assert result.ctypes.data == out.ctypes.data
+    assert (out == me.Remap(frame)).all()
+    with pytest.raises(ValueError):
+        me.Remap(frame, out=np.empty((240, 448), np.int32))
+
+
+@pytest.mark.parametrize('method', range(7))
+def test_stats(method):
+    frame = cv2.imread('images/kiki.png', 0)
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    me.set_SearchMethod(np.array([method], dtype=np.int32))
+    me.set_EffortMap(np.array([1]))
+    me.Estimate(frame, np.roll(frame, 3, axis=1))
+    me.Remap(frame)
+    stats = me.GetStats()
+    # Every method scores its positions through the counted helpers
+    assert stats['evaluations'] > 0
+    assert stats['evaluations'] == me.get_EvaluationCount()[0]
+    assert stats['evaluations'] >= stats['terminated']
+    assert stats['search_ms'] > 0 and stats['remap_ms'] > 0
+    assert stats['effort'].shape == (15, 28)
+    assert stats['effort'].sum() == stats['evaluations']
+
+
+@pytest.mark.parametrize('levels', [1, 3])
+@pytest.mark.parametrize('bidirectional', [False, True])
+def test_stats_seeded(levels, bidirectional):
+    frame = cv2.imread('images/kiki.png', 0)
+    clip = [np.roll(frame, (3 * i, 5 * i), axis=(0, 1)) for i in range(3)]
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    me.set_PyramidLevels(np.array([levels], dtype=np.int32))
+    me.set_EffortMap(np.array([1]))
+    if bidirectional:
+        me.EstimateBidirectional(*clip)
+    else:
+        me.Estimate(clip[0], clip[1])
+    stats = me.GetStats()
+    # The pyramid levels and the seed checks are counted like the search
+    assert stats['evaluations'] == me.get_EvaluationCount()[0]
+    assert stats['effort'].sum() == stats['evaluations']
+
+
+def test_remap_with_metrics():
+    frame = cv2.imread('images/kiki.png', 0)
+    current = np.roll(frame, 3, axis=0)
+    me = me_estimator.MotionEstimator(448, 240, 100, True)
+    me.Estimate(frame, current)
+    compensated, metrics = me.RemapWithMetrics(frame, current)
+    assert (compensated == me.Remap(frame)).all()
+    difference = compensated.astype(np.int64) - current
+    assert metrics.sad == np.abs(difference).sum()
+    assert metrics.mse == pytest.approx((difference ** 2).mean())
+    assert metrics.psnr == pytest.approx(compare_psnr(current, compensated))
+    assert metrics.ssim == pytest.approx(compare_ssim(current, compensated), abs=1e-6)
+
+
+def test_video_pipeline(tmp_path):
+    frame = cv2.imread('images/kiki.png', 0)
+    height, width = frame.shape
+    clip = tmp_path / 'clip.y4m'
+    with open(clip, 'wb') as f:
+        f.write('YUV4MPEG2 W{} H{} F25:1 Ip A1:1 Cmono\n'.format(width, height).encode())
+        for shift in range(4):
+            f.write(b'FRAME\n')
+            f.write(np.roll(frame, shift, axis=0).tobytes())
+    me = me_estimator.MotionEstimator(width, height, 100, False)
+    stats = me_estimator.VideoPipeline(me).Run(str(clip), str(tmp_path / 'field.mevf'), str(tmp_path / 'out.y4m'))
+    assert stats.frames == 3
+
+    cells = (height // 8) * (width // 8)
+    record = np.dtype([('dy', '<i2'), ('dx', '<i2'), ('plane', 'u1'), ('split', 'u1'), ('reference', 'u1'), ('reserved', 'u1'), ('error', '<i4')])
+    data = open(tmp_path / 'field.mevf', 'rb').read()
+    assert data[:4] == b'MEVF'
+    fields = np.frombuffer(data[20:], record).reshape(3, height // 8, width // 8)
+    assert len(data) == 20 + 3 * cells * record.itemsize
+    # Every frame moves down by one row
+    assert np.median(fields['dy'][:, 2:-2, 2:-2]) == -1
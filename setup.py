@@ -1,22 +1,78 @@
+import os
+
 import pybind11
 from distutils.core import setup, Extension
+from distutils.command.build_clib import build_clib
+from distutils.command.build_ext import build_ext
+
+# The core has no Python dependency, it is built once as libme_core.a and
+# linked into the extension and the benchmark. C++ projects can link the
+# same archive, see README.
+core_sources = ['my_motion_estimator.cpp', 'matrix.cpp',  'my_metric.cpp', 'halfpel.cpp', 'thread_pool.cpp', 'motion_field.cpp', 'frame_quality.cpp', 'video_pipeline.cpp']
+# Architecture flags of the core, ME_ARCH_FLAGS="" builds a portable library.
+# The SIMD kernels are dispatched at run time either way.
+arch_args = os.environ.get('ME_ARCH_FLAGS', '-march=native').split()
+# Link-time optimisation across the core and the code that calls it, every
+# link below has to repeat -flto
+lto_args = ['-flto=auto']
+compile_args = ['-std=c++2a', '-O3', '-Wall', '-pthread'] + lto_args
+link_args = ['-pthread'] + lto_args
 
 ext_modules = [
     Extension(
         'me_estimator',
-        ['my_motion_estimator.cpp', 'matrix.cpp',  'my_metric.cpp', 'main.cpp'],
+        ['main.cpp'],
         include_dirs=[pybind11.get_include()],
         language='c++',
-        extra_compile_args=['-std=c++2a', '-Wall']
+        extra_compile_args=compile_args + arch_args,
+        extra_link_args=link_args + arch_args
     ),
 ]
 
+
+class build_core_library(build_clib):
+    """build_clib that passes the compile flags of every library and archives with gcc-ar, which keeps the LTO symbol table"""
+
+    def build_libraries(self, libraries):
+        if self.compiler.compiler_type == 'unix':
+            self.compiler.set_executables(archiver=['gcc-ar', '-cr'])
+        for (lib_name, build_info) in libraries:
+            objects = self.compiler.compile(
+                build_info['sources'],
+                output_dir=self.build_temp,
+                extra_postargs=build_info.get('cflags'),
+            )
+            self.compiler.create_static_lib(objects, lib_name, output_dir=self.build_clib)
+
+
+class build_ext_with_benchmark(build_ext):
+    """Also links the native benchmark, ./me_benchmark, against the core library"""
+
+    def run(self):
+        build_ext.run(self)
+        core = self.get_finalized_command('build_clib')
+        objects = self.compiler.compile(
+            ['benchmark.cpp'],
+            output_dir=self.build_temp,
+            extra_postargs=compile_args + arch_args,
+        )
+        self.compiler.link_executable(
+            objects,
+            'me_benchmark',
+            libraries=core.get_library_names(),
+            library_dirs=[core.build_clib],
+            extra_postargs=link_args + arch_args,
+            target_lang='c++',
+        )
+
 setup(
     name='library',
     version='0.0.1',
     author='Martynov Eduard, 210',
     author_email='git.mart.eduard@gmail.com',
     description='ME estimator template for MSU VideoCourse',
+    libraries=[('me_core', {'sources': core_sources, 'cflags': compile_args + arch_args})],
     ext_modules=ext_modules,
+    cmdclass={'build_clib': build_core_library, 'build_ext': build_ext_with_benchmark},
     requires=['pybind11']
 )
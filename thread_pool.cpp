@@ -0,0 +1,79 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t thread_count) :
+    _thread_count(thread_count == 0 ? 1 : thread_count),
+    _job(nullptr),
+    _generation(0),
+    _running(0),
+    _stop(false) {
+        for (size_t i = 1; i < _thread_count; i++) {
+            _workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+        }
+    }
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(const std::function<void(size_t)>& job) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = &job;
+        _error = nullptr;
+        _running = _workers.size();
+        _generation++;
+    }
+    _wake.notify_all();
+
+    try {
+        job(0);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error) {
+            _error = std::current_exception();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this] { return _running == 0; });
+    _job = nullptr;
+    if (_error) {
+        std::rethrow_exception(_error);
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    size_t seen_generation = 0;
+    while (true) {
+        const std::function<void(size_t)>* job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [&] { return _stop || _generation != seen_generation; });
+            if (_stop) {
+                return;
+            }
+            seen_generation = _generation;
+            job = _job;
+        }
+        try {
+            (*job)(index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_error) {
+                _error = std::current_exception();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running--;
+        }
+        _done.notify_one();
+    }
+}
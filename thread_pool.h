@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that all run the same job. The thread calling
+// Run takes part as worker 0, so a pool of size 1 starts no threads at all.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const {
+        return this -> _thread_count;
+    };
+    // Calls job(worker_index) once on every worker and waits for all of them.
+    // The first exception thrown by a worker is rethrown here.
+    void Run(const std::function<void(size_t)>& job);
+private:
+    void WorkerLoop(size_t index);
+
+    size_t _thread_count;
+    std::vector<std::thread> _workers;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    const std::function<void(size_t)>* _job;
+    std::exception_ptr _error;
+    size_t _generation;
+    size_t _running;
+    bool _stop;
+};
@@ -0,0 +1,306 @@
+#include "video_pipeline.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Hands ring slot indices from one stage to the next. Pop blocks until a
+// slot arrives and returns false once the queue is closed and drained.
+class SlotQueue {
+public:
+    void Push(int slot) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            this -> _slots.push_back(slot);
+        }
+        _ready.notify_one();
+    };
+    bool Pop(int& slot) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this] { return !_slots.empty() || _closed; });
+        if (_slots.empty()) {
+            return false;
+        }
+        slot = _slots.front();
+        _slots.pop_front();
+        return true;
+    };
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            this -> _closed = true;
+        }
+        _ready.notify_all();
+    };
+private:
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<int> _slots;
+    bool _closed = false;
+};
+
+class FrameReader {
+public:
+    FrameReader(const std::string& path, int width, int height) :
+        _input(path, std::ios::binary),
+        _width(width),
+        _height(height),
+        _frame_rate("25:1") {
+        if (!_input) {
+            throw std::runtime_error("Can not open " + path);
+        }
+        this -> _chroma_size = 2 * size_t((width + 1) / 2) * ((height + 1) / 2);
+        this -> _is_y4m = path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+        if (_is_y4m) {
+            ParseHeader();
+        }
+    }
+    const std::string& getFrameRate() const {
+        return this -> _frame_rate;
+    };
+    // False at the end of the clip, a truncated last frame is dropped
+    bool Read(unsigned char* luma) {
+        if (_is_y4m) {
+            std::string line;
+            if (!std::getline(_input, line)) {
+                return false;
+            }
+            if (line.compare(0, 5, "FRAME") != 0) {
+                throw std::runtime_error("Broken Y4M frame header");
+            }
+        }
+        if (!_input.read(reinterpret_cast<char*>(luma), size_t(_width) * _height)) {
+            return false;
+        }
+        _input.ignore(_chroma_size);
+        return true;
+    };
+private:
+    void ParseHeader() {
+        std::string line;
+        std::getline(_input, line);
+        std::istringstream tokens(line);
+        std::string token;
+        tokens >> token;
+        if (token != "YUV4MPEG2") {
+            throw std::runtime_error("Not a Y4M file");
+        }
+        int width = 0, height = 0;
+        std::string colour_space = "420";
+        while (tokens >> token) {
+            if (token[0] == 'W') {
+                width = std::stoi(token.substr(1));
+            } else if (token[0] == 'H') {
+                height = std::stoi(token.substr(1));
+            } else if (token[0] == 'F') {
+                this -> _frame_rate = token.substr(1);
+            } else if (token[0] == 'C') {
+                colour_space = token.substr(1);
+            }
+        }
+        if (width != _width || height != _height) {
+            throw std::invalid_argument(
+                "Y4M frames are " + std::to_string(width) + "x" + std::to_string(height) +
+                ", the estimator expects " + std::to_string(_width) + "x" + std::to_string(_height)
+            );
+        }
+        if (colour_space.compare(0, 4, "mono") == 0) {
+            this -> _chroma_size = 0;
+        } else if (colour_space.compare(0, 3, "444") == 0) {
+            this -> _chroma_size = 2 * size_t(_width) * _height;
+        } else if (colour_space.compare(0, 3, "422") == 0) {
+            this -> _chroma_size = 2 * size_t((_width + 1) / 2) * _height;
+        }
+    };
+
+    std::ifstream _input;
+    int _width;
+    int _height;
+    size_t _chroma_size;
+    bool _is_y4m;
+    std::string _frame_rate;
+};
+
+}
+
+VideoPipeline::VideoPipeline(MotionEstimator& estimator, int ring_size) :
+    _estimator(estimator),
+    _ring_size(std::max(ring_size, 3)) {}
+
+void VideoPipeline::PackVectors(std::vector<VectorRecord>& records) const {
+    // The file has the cell layout of MotionField, only the arrays are interleaved
+    const MotionField& field = _estimator.getMotionField();
+    size_t cells = size_t(field.getRows()) * field.getColumns();
+    for (size_t cell = 0; cell < cells; cell++) {
+        VectorRecord& record = records[cell];
+        record.dy = field._dy[cell];
+        record.dx = field._dx[cell];
+        record.plane = field._phase[cell];
+        record.split = field._depth[cell];
+        record.reference = field._reference[cell];
+        record.reserved = 0;
+        record.error = field._cost[cell];
+    }
+}
+
+PipelineStats VideoPipeline::Run(
+    const std::string& input_path,
+    const std::string& vectors_path,
+    const std::string& frames_path,
+    int max_frames
+) {
+    Clock::time_point start = Clock::now();
+    // Every frame is estimated and compensated in one go
+    std::lock_guard<std::mutex> estimator_lock(_estimator.getMutex());
+    const int width = _estimator.getWidth();
+    const int height = _estimator.getHeight();
+    const int cell_rows = _estimator.getMotionField().getRows();
+    const int cell_columns = _estimator.getMotionField().getColumns();
+    const bool compensate = !frames_path.empty();
+
+    FrameReader reader(input_path, width, height);
+    std::ofstream vectors_output(vectors_path, std::ios::binary);
+    if (!vectors_output) {
+        throw std::runtime_error("Can not open " + vectors_path);
+    }
+    std::ofstream frames_output;
+    if (compensate) {
+        frames_output.open(frames_path, std::ios::binary);
+        if (!frames_output) {
+            throw std::runtime_error("Can not open " + frames_path);
+        }
+        frames_output << "YUV4MPEG2 W" << width << " H" << height << " F" << reader.getFrameRate() << " Ip A1:1 Cmono\n";
+    }
+    const int32_t header[4] = {width, height, cell_rows, cell_columns};
+    vectors_output.write("MEVF", 4);
+    vectors_output.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    std::vector<std::vector<unsigned char>> inputs(_ring_size);
+    for (auto& input : inputs) {
+        input.resize(_estimator.getPaddedFrameSize());
+    }
+    struct Output {
+        std::vector<VectorRecord> vectors;
+        std::vector<unsigned char> frame;
+    };
+    std::vector<Output> outputs(_ring_size);
+    for (auto& output : outputs) {
+        output.vectors.resize(size_t(cell_rows) * cell_columns);
+        output.frame.resize(compensate ? size_t(height) * width : 0);
+    }
+
+    SlotQueue free_inputs, read_inputs, free_outputs, done_outputs;
+    for (int slot = 0; slot < _ring_size; slot++) {
+        free_inputs.Push(slot);
+        free_outputs.Push(slot);
+    }
+    PipelineStats stats;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    // Closing every queue makes all stages run out of work
+    auto fail = [&](std::exception_ptr exception) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = exception;
+            }
+        }
+        free_inputs.Close();
+        read_inputs.Close();
+        free_outputs.Close();
+        done_outputs.Close();
+    };
+
+    std::thread reader_thread([&] {
+        try {
+            int slot;
+            for (int frame = 0; max_frames < 0 || frame < max_frames; frame++) {
+                if (!free_inputs.Pop(slot)) {
+                    break;
+                }
+                Clock::time_point read_start = Clock::now();
+                unsigned char* luma = inputs[slot].data();
+                if (!reader.Read(luma)) {
+                    break;
+                }
+                _estimator.PadFrame(luma);
+                stats.read_seconds += Seconds(read_start);
+                read_inputs.Push(slot);
+            }
+            read_inputs.Close();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+    std::thread writer_thread([&] {
+        try {
+            int slot;
+            while (done_outputs.Pop(slot)) {
+                Clock::time_point write_start = Clock::now();
+                vectors_output.write(
+                    reinterpret_cast<const char*>(outputs[slot].vectors.data()),
+                    outputs[slot].vectors.size() * sizeof(VectorRecord)
+                );
+                if (compensate) {
+                    frames_output << "FRAME\n";
+                    frames_output.write(reinterpret_cast<const char*>(outputs[slot].frame.data()), outputs[slot].frame.size());
+                }
+                if (!vectors_output || (compensate && !frames_output)) {
+                    throw std::runtime_error("Writing the results failed");
+                }
+                stats.write_seconds += Seconds(write_start);
+                free_outputs.Push(slot);
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+
+    try {
+        int previous = -1, current, output;
+        while (read_inputs.Pop(current)) {
+            if (previous >= 0) {
+                if (!free_outputs.Pop(output)) {
+                    break;
+                }
+                Clock::time_point estimate_start = Clock::now();
+                _estimator.EstimateFrame(inputs[previous].data(), inputs[current].data());
+                if (compensate) {
+                    _estimator.RemapFrame(outputs[output].frame.data());
+                }
+                PackVectors(outputs[output].vectors);
+                stats.estimate_seconds += Seconds(estimate_start);
+                stats.frames++;
+                done_outputs.Push(output);
+                // RemapFrame was the last reader of the previous frame
+                free_inputs.Push(previous);
+            }
+            previous = current;
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    done_outputs.Close();
+    free_inputs.Close();
+    reader_thread.join();
+    writer_thread.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    stats.total_seconds = Seconds(start);
+    return stats;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "my_motion_estimator.h"
+
+// Seconds spent by every stage of VideoPipeline::Run. The stages run
+// concurrently, so their sum exceeds the wall time.
+struct PipelineStats {
+    // Vector fields written, one less than the frames read
+    int frames = 0;
+    double read_seconds = 0;
+    double estimate_seconds = 0;
+    double write_seconds = 0;
+    double total_seconds = 0;
+};
+
+// One cell of the vector field file, the cells are those of MotionField
+struct VectorRecord {
+    // Displacement of the cell in the previous frame, in pixels
+    int16_t dy;
+    int16_t dx;
+    // Half-pixel plane: 0 - none, 1 - up, 2 - left, 3 - up-left
+    uint8_t plane;
+    // Splits between the block and the leaf of the cell
+    uint8_t split;
+    // Reference frame: 0 - the previous frame, i - the one i frames earlier
+    uint8_t reference;
+    uint8_t reserved;
+    int32_t error;
+};
+
+// Streams a clip through the estimator without going back to Python.
+// A reader thread fills a ring of luma buffers, the calling thread estimates
+// (and compensates) every frame against the one before it, and a writer
+// thread stores the results. Only the luma plane is used.
+//
+// Input is Y4M if the name ends in .y4m, raw planar YUV 4:2:0 of the
+// estimator size otherwise. The vector file starts with "MEVF" followed by
+// int32 width, height, cell rows and cell columns, then every frame is
+// rows x columns VectorRecord in native byte order. Compensated frames are
+// written as a monochrome Y4M.
+class VideoPipeline {
+public:
+    VideoPipeline(MotionEstimator& estimator, int ring_size = 4);
+
+    // Reads at most max_frames frames, all of them if it is negative.
+    // Compensation is skipped when frames_path is empty.
+    PipelineStats Run(
+        const std::string& input_path,
+        const std::string& vectors_path,
+        const std::string& frames_path = "",
+        int max_frames = -1
+    );
+private:
+    void PackVectors(std::vector<VectorRecord>& records) const;
+
+    MotionEstimator& _estimator;
+    const int _ring_size;
+};